@@ -19,6 +19,12 @@
 #  ROOTFS_$(FSTYPE)_POST_GEN_HOOKS, a list of hooks to call after
 #  generating the filesystem image
 #
+#  ROOTFS_$(FSTYPE)_INCREMENTAL_CMD, the command that updates an
+#  existing filesystem image $$@ with the entries listed in
+#  $(ROOTFS_$(FSTYPE)_CHANGES), when BR2_TARGET_ROOTFS_INCREMENTAL is
+#  enabled. ROOTFS_$(FSTYPE)_INCREMENTAL_OPTS are passed to
+#  'rootfs-manifest diff' to generate that list.
+#
 # In terms of configuration option, this macro assumes that the
 # BR2_TARGET_ROOTFS_$(FSTYPE) config option allows to enable/disable
 # the generation of a filesystem image of a particular type. If
@@ -33,11 +39,31 @@ ROOTFS_DEVICE_TABLES = $(call qstrip,$(BR2_ROOTFS_DEVICE_TABLE) \
 
 ROOTFS_USERS_TABLES = $(call qstrip,$(BR2_ROOTFS_USERS_TABLES))
 
+# Parallel compressors (pigz, xz, zstd) produce the same output whatever
+# the number of threads, but only as long as they use their
+# multi-threaded code path, i.e. the input is split in blocks of a size
+# that does not depend on the number of threads. pigz and xz fall back
+# to a different, single-threaded, code path when asked for one thread,
+# so never use less than two. xz 5.2 also falls back to it when a memory
+# usage limit (e.g. XZ_DEFAULTS=--memlimit=...) lowers the number of
+# threads to one.
+ROOTFS_COMPRESS_JOBS = $(if $(filter 1,$(PARALLEL_JOBS)),2,$(PARALLEL_JOBS))
+
 ROOTFS_FULL_DEVICES_TABLE = $(FS_DIR)/full_devices_table.txt
 ROOTFS_FULL_USERS_TABLE = $(FS_DIR)/full_users_table.txt
 
+# Not below FS_DIR, which is cleaned on each run
+ROOTFS_INCREMENTAL_DIR = $(BUILD_DIR)/buildroot-fs-incremental
+ROOTFS_MANIFEST = $(HOST_DIR)/bin/python3 $(TOPDIR)/support/scripts/rootfs-manifest
+
 ROOTFS_COMMON_NAME = rootfs-common
 ROOTFS_COMMON_TYPE = rootfs
+# Only used with BR2_TARGET_ROOTFS_SHARED_STAGING, to hold the staging
+# tree and the fakeroot state shared by all the filesystem images
+ROOTFS_COMMON_DIR = $(FS_DIR)/common
+ROOTFS_COMMON_TARGET_DIR = $(ROOTFS_COMMON_DIR)/target
+ROOTFS_COMMON_FAKEROOT_SCRIPT = $(ROOTFS_COMMON_DIR)/fakeroot
+ROOTFS_COMMON_FAKEROOT_DB = $(ROOTFS_COMMON_DIR)/fakeroot.db
 ROOTFS_COMMON_DEPENDENCIES = \
 	host-fakeroot host-makedevs \
 	$(BR2_TAR_HOST_DEPENDENCY) \
@@ -59,6 +85,52 @@ endef
 ROOTFS_COMMON_DEPENDENCIES += host-policycoreutils
 endif
 
+# Append to the fakeroot script $(1) the commands that turn a copy of
+# the target directory into the root filesystem contents: ownership,
+# users, device nodes, pre-command hooks and post-fakeroot scripts.
+define rootfs-fakeroot-prepare
+	echo "chown -h -R 0:0 $(TARGET_DIR)" >> $(1)
+	PATH=$(BR_PATH) $(TOPDIR)/support/scripts/mkusers $(ROOTFS_FULL_USERS_TABLE) $(TARGET_DIR) >> $(1)
+	echo "$(HOST_DIR)/bin/makedevs -d $(ROOTFS_FULL_DEVICES_TABLE) $(TARGET_DIR)" >> $(1)
+	$(foreach hook,$(ROOTFS_PRE_CMD_HOOKS),\
+		$(call PRINTF,$($(hook))) >> $(1)$(sep))
+	$(foreach s,$(call qstrip,$(BR2_ROOTFS_POST_FAKEROOT_SCRIPT)),\
+		echo "echo '$(TERM_BOLD)>>>   Executing fakeroot script $(s)$(TERM_RESET)'" >> $(1); \
+		echo $(EXTRA_ENV) $(s) $(TARGET_DIR) $(BR2_ROOTFS_POST_SCRIPT_ARGS) >> $(1)$(sep))
+endef
+
+# Append to the fakeroot script $(1) the commands that must run last,
+# just before an image is generated.
+define rootfs-fakeroot-finalize
+	echo "find $(TARGET_DIR)/run/ -mindepth 1 -prune -print0 | xargs -0r rm -rf --" >> $(1)
+	echo "find $(TARGET_DIR)/tmp/ -mindepth 1 -prune -print0 | xargs -0r rm -rf --" >> $(1)
+	$(call PRINTF,$(ROOTFS_REPRODUCIBLE)) >> $(1)
+	$(call PRINTF,$(ROOTFS_SELINUX)) >> $(1)
+endef
+
+# Command generating the image of filesystem $(1), updating the
+# previous one incrementally when the changes since the manifest of the
+# previous run allow it. The manifest is removed while the image is
+# being modified, so that an interrupted update leads to a full
+# regeneration on the next run.
+define rootfs-incremental
+mkdir -p $(ROOTFS_INCREMENTAL_DIR)
+$(ROOTFS_MANIFEST) generate --previous $(ROOTFS_$(1)_MANIFEST) \
+	--key $(FAKEROOT_SCRIPT) $(TARGET_DIR) > $(ROOTFS_$(1)_MANIFEST).new
+if [ -e $@ ] && $(ROOTFS_MANIFEST) diff $(ROOTFS_$(1)_INCREMENTAL_OPTS) \
+	--root $(TARGET_DIR) --image $@ \
+	$(ROOTFS_$(1)_MANIFEST) $(ROOTFS_$(1)_MANIFEST).new > $(ROOTFS_$(1)_CHANGES); then
+rm -f $(ROOTFS_$(1)_MANIFEST)
+echo "Updating $@ incrementally"
+$(ROOTFS_$(1)_INCREMENTAL_CMD)
+else
+rm -f $(ROOTFS_$(1)_MANIFEST)
+$(ROOTFS_$(1)_CMD)
+fi
+$(ROOTFS_MANIFEST) seal $(ROOTFS_$(1)_MANIFEST).new $@
+mv $(ROOTFS_$(1)_MANIFEST).new $(ROOTFS_$(1)_MANIFEST)
+endef
+
 ROOTFS_COMMON_FINAL_RECURSIVE_DEPENDENCIES = $(sort \
 	$(if $(filter undefined,$(origin ROOTFS_COMMON_FINAL_RECURSIVE_DEPENDENCIES__X)), \
 		$(eval ROOTFS_COMMON_FINAL_RECURSIVE_DEPENDENCIES__X := \
@@ -89,6 +161,27 @@ endif
 ifeq ($(BR2_ROOTFS_DEVICE_CREATION_STATIC),y)
 	$(call PRINTF,$(PACKAGES_DEVICES_TABLE)) >> $(ROOTFS_FULL_DEVICES_TABLE)
 endif
+ifeq ($(BR2_TARGET_ROOTFS_SHARED_STAGING),y)
+	@$(call MESSAGE,"Preparing shared root filesystem staging")
+	rm -rf $(ROOTFS_COMMON_DIR)
+	mkdir -p $(ROOTFS_COMMON_DIR)
+	rsync -auH \
+		--exclude=/$(notdir $(TARGET_DIR_WARNING_FILE)) \
+		$(BASE_TARGET_DIR)/ \
+		$(TARGET_DIR)
+	echo '#!/bin/sh' > $(ROOTFS_COMMON_FAKEROOT_SCRIPT)
+	echo "set -e" >> $(ROOTFS_COMMON_FAKEROOT_SCRIPT)
+	$(call rootfs-fakeroot-prepare,$(ROOTFS_COMMON_FAKEROOT_SCRIPT))
+	$(call rootfs-fakeroot-finalize,$(ROOTFS_COMMON_FAKEROOT_SCRIPT))
+	chmod a+x $(ROOTFS_COMMON_FAKEROOT_SCRIPT)
+	PATH=$(BR_PATH) FAKEROOTDONTTRYCHOWN=1 $(HOST_DIR)/bin/fakeroot \
+		-s $(ROOTFS_COMMON_FAKEROOT_DB) -- $(ROOTFS_COMMON_FAKEROOT_SCRIPT)
+endif
+
+ifeq ($(BR2_TARGET_ROOTFS_SHARED_STAGING),y)
+# The staging tree is prepared as TARGET_DIR, like the per-image copies
+rootfs-common: ROOTFS=COMMON
+endif
 
 rootfs-common-show-depends:
 	@echo $(ROOTFS_COMMON_DEPENDENCIES)
@@ -107,10 +200,26 @@ ROOTFS_$(2)_TYPE = rootfs
 ROOTFS_$(2)_IMAGE_NAME ?= rootfs.$(1)
 ROOTFS_$(2)_FINAL_IMAGE_NAME = $$(strip $$(ROOTFS_$(2)_IMAGE_NAME))
 ROOTFS_$(2)_DIR = $$(FS_DIR)/$(1)
-ROOTFS_$(2)_TARGET_DIR = $$(ROOTFS_$(2)_DIR)/target
+
+# With a shared staging, images without pre-gen hooks are generated
+# straight from the common staging tree, which they must not modify.
+# The others work on their own copy of it, made within fakeroot so
+# that the ownership recorded in the shared state follows the copy.
+ROOTFS_$(2)_USE_STAGING = $$(if $$(BR2_TARGET_ROOTFS_SHARED_STAGING),$$(if $$(ROOTFS_$(2)_PRE_GEN_HOOKS),copy,direct))
+ROOTFS_$(2)_TARGET_DIR = \
+	$$(if $$(filter direct,$$(ROOTFS_$(2)_USE_STAGING)),$$(ROOTFS_COMMON_TARGET_DIR),$$(ROOTFS_$(2)_DIR)/target)
 
 ROOTFS_$(2)_DEPENDENCIES += rootfs-common
 
+ifeq ($$(BR2_TARGET_ROOTFS_INCREMENTAL),y)
+ifneq ($$(ROOTFS_$(2)_INCREMENTAL_CMD),)
+ROOTFS_$(2)_INCREMENTAL = y
+ROOTFS_$(2)_DEPENDENCIES += host-python3
+endif
+endif
+ROOTFS_$(2)_MANIFEST = $$(ROOTFS_INCREMENTAL_DIR)/$(1).manifest
+ROOTFS_$(2)_CHANGES = $$(ROOTFS_$(2)_DIR)/changes
+
 ROOTFS_$(2)_FINAL_RECURSIVE_DEPENDENCIES = $$(sort \
 	$$(if $$(filter undefined,$$(origin ROOTFS_$(2)_FINAL_RECURSIVE_DEPENDENCIES__X)), \
 		$$(eval ROOTFS_$(2)_FINAL_RECURSIVE_DEPENDENCIES__X := \
@@ -124,8 +233,9 @@ ROOTFS_$(2)_FINAL_RECURSIVE_DEPENDENCIES = $$(sort \
 	$$(ROOTFS_$(2)_FINAL_RECURSIVE_DEPENDENCIES__X))
 
 ifeq ($$(BR2_TARGET_ROOTFS_$(2)_GZIP),y)
+ROOTFS_$(2)_DEPENDENCIES += host-pigz
 ROOTFS_$(2)_COMPRESS_EXT = .gz
-ROOTFS_$(2)_COMPRESS_CMD = gzip -9 -c -n
+ROOTFS_$(2)_COMPRESS_CMD = pigz -9 -c -n -p $$(ROOTFS_COMPRESS_JOBS)
 endif
 ifeq ($$(BR2_TARGET_ROOTFS_$(2)_BZIP2),y)
 ROOTFS_$(2)_COMPRESS_EXT = .bz2
@@ -149,15 +259,15 @@ endif
 ifeq ($$(BR2_TARGET_ROOTFS_$(2)_XZ),y)
 ROOTFS_$(2)_DEPENDENCIES += host-xz
 ROOTFS_$(2)_COMPRESS_EXT = .xz
-ROOTFS_$(2)_COMPRESS_CMD = xz -9 -C crc32 -c
-ifeq ($(BR2_REPRODUCIBLE),)
-ROOTFS_$(2)_COMPRESS_CMD += -T $(PARALLEL_JOBS)
-endif
+# In multi-threaded mode, xz splits its input in blocks of three times
+# the dictionary size (192MiB at -9), independently of the number of
+# threads.
+ROOTFS_$(2)_COMPRESS_CMD = xz -9 -C crc32 -c -T $$(ROOTFS_COMPRESS_JOBS)
 endif
 ifeq ($(BR2_TARGET_ROOTFS_$(2)_ZSTD),y)
 ROOTFS_$(2)_DEPENDENCIES += host-zstd
 ROOTFS_$(2)_COMPRESS_EXT = .zst
-ROOTFS_$(2)_COMPRESS_CMD = zstd -19 -z -f -T$(PARALLEL_JOBS)
+ROOTFS_$(2)_COMPRESS_CMD = zstd -19 -z -f -c -T$$(ROOTFS_COMPRESS_JOBS)
 endif
 
 $$(BINARIES_DIR)/$$(ROOTFS_$(2)_FINAL_IMAGE_NAME): ROOTFS=$(2)
@@ -167,33 +277,28 @@ $$(BINARIES_DIR)/$$(ROOTFS_$(2)_FINAL_IMAGE_NAME): $$(ROOTFS_$(2)_DEPENDENCIES)
 	mkdir -p $$(@D)
 	rm -rf $$(ROOTFS_$(2)_DIR)
 	mkdir -p $$(ROOTFS_$(2)_DIR)
-	rsync -auH \
+	$$(if $$(ROOTFS_$(2)_USE_STAGING),,rsync -auH \
 		--exclude=/$$(notdir $$(TARGET_DIR_WARNING_FILE)) \
 		$$(BASE_TARGET_DIR)/ \
-		$$(TARGET_DIR)
+		$$(TARGET_DIR))
 
 	echo '#!/bin/sh' > $$(FAKEROOT_SCRIPT)
 	echo "set -e" >> $$(FAKEROOT_SCRIPT)
 
-	echo "chown -h -R 0:0 $$(TARGET_DIR)" >> $$(FAKEROOT_SCRIPT)
-	PATH=$$(BR_PATH) $$(TOPDIR)/support/scripts/mkusers $$(ROOTFS_FULL_USERS_TABLE) $$(TARGET_DIR) >> $$(FAKEROOT_SCRIPT)
-	echo "$$(HOST_DIR)/bin/makedevs -d $$(ROOTFS_FULL_DEVICES_TABLE) $$(TARGET_DIR)" >> $$(FAKEROOT_SCRIPT)
-	$$(foreach hook,$$(ROOTFS_PRE_CMD_HOOKS),\
-		$$(call PRINTF,$$($$(hook))) >> $$(FAKEROOT_SCRIPT)$$(sep))
-	$$(foreach s,$$(call qstrip,$$(BR2_ROOTFS_POST_FAKEROOT_SCRIPT)),\
-		echo "echo '$$(TERM_BOLD)>>>   Executing fakeroot script $$(s)$$(TERM_RESET)'" >> $$(FAKEROOT_SCRIPT); \
-		echo $$(EXTRA_ENV) $$(s) $$(TARGET_DIR) $$(BR2_ROOTFS_POST_SCRIPT_ARGS) >> $$(FAKEROOT_SCRIPT)$$(sep))
+	$$(if $$(ROOTFS_$(2)_USE_STAGING),,$$(call rootfs-fakeroot-prepare,$$(FAKEROOT_SCRIPT)))
+	$$(if $$(filter copy,$$(ROOTFS_$(2)_USE_STAGING)),\
+		echo "cp -a --reflink=auto $$(ROOTFS_COMMON_TARGET_DIR) $$(TARGET_DIR)" >> $$(FAKEROOT_SCRIPT))
 
 	$$(foreach hook,$$(ROOTFS_$(2)_PRE_GEN_HOOKS),\
 		$$(call PRINTF,$$($$(hook))) >> $$(FAKEROOT_SCRIPT)$$(sep))
-	echo "find $$(TARGET_DIR)/run/ -mindepth 1 -prune -print0 | xargs -0r rm -rf --" >> $$(FAKEROOT_SCRIPT)
-	echo "find $$(TARGET_DIR)/tmp/ -mindepth 1 -prune -print0 | xargs -0r rm -rf --" >> $$(FAKEROOT_SCRIPT)
-	$$(call PRINTF,$$(ROOTFS_REPRODUCIBLE)) >> $$(FAKEROOT_SCRIPT)
-	$$(call PRINTF,$$(ROOTFS_SELINUX)) >> $$(FAKEROOT_SCRIPT)
-	$$(call PRINTF,$$(ROOTFS_$(2)_CMD)) >> $$(FAKEROOT_SCRIPT)
+	$$(if $$(filter direct,$$(ROOTFS_$(2)_USE_STAGING)),,$$(call rootfs-fakeroot-finalize,$$(FAKEROOT_SCRIPT)))
+	$$(call PRINTF,$$(if $$(ROOTFS_$(2)_INCREMENTAL),\
+		$$(call rootfs-incremental,$(2)),$$(ROOTFS_$(2)_CMD))) >> $$(FAKEROOT_SCRIPT)
 	chmod a+x $$(FAKEROOT_SCRIPT)
-	PATH=$$(BR_PATH) FAKEROOTDONTTRYCHOWN=1 $$(HOST_DIR)/bin/fakeroot -- $$(FAKEROOT_SCRIPT)
-	$(Q)rm -rf $$(TARGET_DIR)
+	PATH=$$(BR_PATH) FAKEROOTDONTTRYCHOWN=1 $$(HOST_DIR)/bin/fakeroot \
+		$$(if $$(ROOTFS_$(2)_USE_STAGING),-i $$(ROOTFS_COMMON_FAKEROOT_DB)) \
+		-- $$(FAKEROOT_SCRIPT)
+	$$(if $$(filter direct,$$(ROOTFS_$(2)_USE_STAGING)),,$(Q)rm -rf $$(TARGET_DIR))
 ifneq ($$(ROOTFS_$(2)_COMPRESS_CMD),)
 	PATH=$$(BR_PATH) $$(ROOTFS_$(2)_COMPRESS_CMD) $$@ > $$@$$(ROOTFS_$(2)_COMPRESS_EXT)
 endif
@@ -46,6 +46,14 @@ define ROOTFS_CPIO_CMD
 	> $@
 endef
 
+# The kernel unpacks concatenated archives in order, so the appended
+# entries override the previous ones.
+define ROOTFS_CPIO_INCREMENTAL_CMD
+	cd $(TARGET_DIR) && \
+	cpio $(ROOTFS_CPIO_OPTS) --null --quiet -o -H newc \
+	< $(ROOTFS_CPIO_CHANGES) >> $@
+endef
+
 else ifeq ($(BR2_TARGET_ROOTFS_CPIO_DRACUT),y)
 
 ROOTFS_CPIO_DEPENDENCIES += host-dracut
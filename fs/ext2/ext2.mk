@@ -37,6 +37,20 @@ define ROOTFS_EXT2_CMD
 	}
 endef
 
+ROOTFS_EXT2_INCREMENTAL_OPTS = --allow-removals --format debugfs
+
+# debugfs does not fail on errors, so check it did not report any
+# other than its version banner. When the changes could not be applied
+# (e.g. the image is full), the image is generated from scratch.
+define ROOTFS_EXT2_INCREMENTAL_CMD
+	if ! $(HOST_DIR)/sbin/debugfs -w -f $(ROOTFS_EXT2_CHANGES) $@ \
+		2> $(ROOTFS_EXT2_DIR)/debugfs.log >/dev/null || \
+		grep -v '^debugfs ' $(ROOTFS_EXT2_DIR)/debugfs.log >&2; then
+	echo "*** Could not update $@ incrementally, generating it again" 1>&2
+	$(ROOTFS_EXT2_CMD)
+	fi
+endef
+
 ifneq ($(BR2_TARGET_ROOTFS_EXT2_GEN),2)
 define ROOTFS_EXT2_SYMLINK
 	ln -sf rootfs.ext2$(ROOTFS_EXT2_COMPRESS_EXT) $(BINARIES_DIR)/rootfs.ext$(BR2_TARGET_ROOTFS_EXT2_GEN)$(ROOTFS_EXT2_COMPRESS_EXT)
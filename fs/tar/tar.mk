@@ -16,4 +16,11 @@ define ROOTFS_TAR_CMD
 		tar $(TAR_OPTS) -cf $@ --null --xattrs-include='*' --no-recursion -T - --numeric-owner)
 endef
 
+# Later members override earlier ones on extraction
+define ROOTFS_TAR_INCREMENTAL_CMD
+	(cd $(TARGET_DIR); \
+		tar $(TAR_OPTS) -rf $@ --null --xattrs-include='*' --no-recursion \
+			-T $(ROOTFS_TAR_CHANGES) --numeric-owner)
+endef
+
 $(eval $(rootfs))
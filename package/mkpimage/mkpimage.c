@@ -9,6 +9,9 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <endian.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <libgen.h>
 
 #define VALIDATION_WORD 0x31305341
 
@@ -20,6 +23,7 @@
 #define MAX_V1IMAGE_SIZE (224 * 1024 - 4)
 
 static int add_barebox_header;
+static int update_header;
 
 struct socfpga_header {
 	uint8_t validation_word[4];
@@ -65,42 +69,6 @@ static uint32_t bb_header[] = {
 	0xea00006b,	/* entry. b 0x200 (offset may be adjusted) */
 };
 
-static int read_full(int fd, void *buf, size_t size)
-{
-	size_t insize = size;
-	int now;
-	int total = 0;
-
-	while (size) {
-		now = read(fd, buf, size);
-		if (now == 0)
-			return total;
-		if (now < 0)
-			return now;
-		total += now;
-		size -= now;
-		buf += now;
-	}
-
-	return insize;
-}
-
-static int write_full(int fd, void *buf, size_t size)
-{
-	size_t insize = size;
-	int now;
-
-	while (size) {
-		now = write(fd, buf, size);
-		if (now <= 0)
-			return now;
-		size -= now;
-		buf += now;
-	}
-
-	return insize;
-}
-
 static const uint32_t crc_table[256] = {
 	0x00000000, 0x04c11db7, 0x09823b6e, 0x0d4326d9, 0x130476dc, 0x17c56b6b,
 	0x1a864db2, 0x1e475005, 0x2608edb8, 0x22c9f00f, 0x2f8ad6d6, 0x2b4bcb61,
@@ -147,9 +115,10 @@ static const uint32_t crc_table[256] = {
 	0xbcb4666d, 0xb8757bda, 0xb5365d03, 0xb1f740b4
 };
 
-uint32_t crc32(uint32_t crc, void *_buf, int length)
+/* Reference implementation, one byte per iteration */
+static uint32_t crc32_bytewise(uint32_t crc, const void *_buf, size_t length)
 {
-	uint8_t *buf = _buf;
+	const uint8_t *buf = _buf;
 
 	while (length--)
 		crc = crc << 8 ^ crc_table[(crc >> 24 ^ *(buf++)) & 0xff];
@@ -157,6 +126,150 @@ uint32_t crc32(uint32_t crc, void *_buf, int length)
 	return crc;
 }
 
+/* crc_slice[k][n] is the CRC contribution of byte n followed by k zero
+ * bytes, so that 8 input bytes can be folded in per iteration. */
+static uint32_t crc_slice[8][256];
+
+static void crc32_init(void)
+{
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		crc_slice[0][i] = crc_table[i];
+		for (k = 1; k < 8; k++)
+			crc_slice[k][i] = crc_slice[k - 1][i] << 8 ^
+				crc_table[crc_slice[k - 1][i] >> 24];
+	}
+}
+
+uint32_t crc32(uint32_t crc, const void *_buf, size_t length)
+{
+	const uint8_t *buf = _buf;
+	uint32_t a;
+
+	/* Bring buf to an 8-byte boundary */
+	while (length && ((uintptr_t)buf & 7)) {
+		crc = crc << 8 ^ crc_table[(crc >> 24 ^ *(buf++)) & 0xff];
+		length--;
+	}
+
+	while (length >= 8) {
+		a = crc ^ ((uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16 |
+			   (uint32_t)buf[2] << 8 | buf[3]);
+		crc = crc_slice[7][a >> 24] ^
+		      crc_slice[6][(a >> 16) & 0xff] ^
+		      crc_slice[5][(a >> 8) & 0xff] ^
+		      crc_slice[4][a & 0xff] ^
+		      crc_slice[3][buf[4]] ^
+		      crc_slice[2][buf[5]] ^
+		      crc_slice[1][buf[6]] ^
+		      crc_slice[0][buf[7]];
+		buf += 8;
+		length -= 8;
+	}
+
+	return crc32_bytewise(crc, buf, length);
+}
+
+/* Multiply the 32x32 GF(2) matrix mat by vec */
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+	uint32_t sum = 0;
+
+	while (vec) {
+		if (vec & 1)
+			sum ^= *mat;
+		vec >>= 1;
+		mat++;
+	}
+
+	return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+	int n;
+
+	for (n = 0; n < 32; n++)
+		square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+/* Equivalent to crc32(crc, <len zero bytes>), in O(log(len)) steps.
+ * Since the CRC is linear, this allows updating the CRC of an image
+ * when only its first bytes changed, without reading the rest. */
+static uint32_t crc32_shift(uint32_t crc, size_t len)
+{
+	uint32_t even[32], odd[32];
+	int n;
+
+	/* Operator for one zero bit */
+	for (n = 0; n < 31; n++)
+		odd[n] = 1U << (n + 1);
+	odd[31] = 0x04c11db7;	/* CRC-32 polynomial */
+
+	gf2_matrix_square(even, odd);	/* 2 zero bits */
+	gf2_matrix_square(odd, even);	/* 4 zero bits */
+
+	while (len) {
+		/* First pass turns 4 bits into one zero byte */
+		gf2_matrix_square(even, odd);
+		if (len & 1)
+			crc = gf2_matrix_times(even, crc);
+		len >>= 1;
+		if (!len)
+			break;
+
+		gf2_matrix_square(odd, even);
+		if (len & 1)
+			crc = gf2_matrix_times(odd, crc);
+		len >>= 1;
+	}
+
+	return crc;
+}
+
+/* Check the sliced implementation against the standard check value
+ * and against the bytewise reference for every length and alignment
+ * of a small pseudo-random buffer. */
+static int crc32_selftest(void)
+{
+	static const char check[] = "123456789";
+	uint8_t buf[512];
+	uint32_t seed = 1;
+	size_t off, len;
+
+	if ((crc32(0xffffffff, check, 9) ^ 0xffffffff) != 0xfc891918) {
+		fprintf(stderr, "crc32: check value mismatch\n");
+		return -1;
+	}
+
+	for (off = 0; off < sizeof(buf); off++) {
+		seed = seed * 1103515245 + 12345;
+		buf[off] = seed >> 16;
+	}
+
+	for (off = 0; off < 8; off++) {
+		for (len = 0; len <= sizeof(buf) - off; len++) {
+			if (crc32(0xffffffff, buf + off, len) !=
+			    crc32_bytewise(0xffffffff, buf + off, len)) {
+				fprintf(stderr, "crc32: mismatch at offset %zu, length %zu\n",
+					off, len);
+				return -1;
+			}
+		}
+	}
+
+	for (len = 0; len <= sizeof(buf); len += 37) {
+		memset(buf, 0, len);
+		if (crc32_shift(0x12345678, len) != crc32_bytewise(0x12345678, buf, len)) {
+			fprintf(stderr, "crc32: shift mismatch at length %zu\n", len);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 /* Create an ARM relative branch instuction 
  * branch is where the instruction will be placed and dest points to where
  * it should branch too. */
@@ -170,14 +283,19 @@ static void branch(uint8_t *branch, uint8_t *dest)
 	branch[3] = BRANCH_INST;
 }
 
-/* start_addr is where the socfpga header's start instruction should branch to.
+/* The header, and the trampoline that may follow it, occupy the first
+ * HEADER_AREA bytes of the image. Nothing past that depends on the
+ * header parameters, apart from the trailing CRC. */
+#define HEADER_AREA (0x40 + sizeof(struct socfpga_header) + 4)
+
+/* Fill in the socfpga header only, the CRC is left untouched.
+ * start_addr is where the socfpga header's start instruction should branch to.
  * It should be relative to the start of buf */
-static int add_socfpga_header(void *buf, size_t size, unsigned start_addr, unsigned version)
+static int fill_socfpga_header(void *buf, size_t size, unsigned start_addr, unsigned version)
 {
 	struct socfpga_header *header = buf + 0x40;
 	void *entry;
 	uint8_t *bufp, *sumendp;
-	uint32_t *crc;
 	unsigned checksum;
 
 	if (size & 0x3) {
@@ -246,6 +364,18 @@ static int add_socfpga_header(void *buf, size_t size, unsigned start_addr, unsig
 		header->v1.checksum[1] = (checksum >> 8) & 0xff;;
 	}
 
+	return 0;
+}
+
+static int add_socfpga_header(void *buf, size_t size, unsigned start_addr, unsigned version)
+{
+	uint32_t *crc;
+	int ret;
+
+	ret = fill_socfpga_header(buf, size, start_addr, version);
+	if (ret)
+		return ret;
+
 	crc = buf + size - sizeof(uint32_t);
 
 	*crc = crc32(0xffffffff, buf, size - sizeof(uint32_t));
@@ -254,48 +384,120 @@ static int add_socfpga_header(void *buf, size_t size, unsigned start_addr, unsig
 	return 0;
 }
 
-static void usage(const char *prgname)
+/* Rewrite only the header area of an existing output image (-u), and
+ * update its CRC from the difference between the old and new header
+ * area. This is only done when the rest of outfile is what would be
+ * generated from the current infile, which is compared rather than
+ * guessed from the timestamps.
+ * Returns 0 if the image was updated, non-zero if a full run is needed. */
+static int rewrite_socfpga_header(int fd, const struct stat *s, const char *outfile,
+				  size_t size, int addsize, unsigned start_addr,
+				  unsigned version)
+{
+	uint8_t old[HEADER_AREA], *expected;
+	uint32_t *crc, diff;
+	struct stat os;
+	uint8_t *buf;
+	size_t i;
+	int outfd, ret;
+
+	if (size < HEADER_AREA + sizeof(uint32_t))
+		return -1;
+
+	outfd = open(outfile, O_RDWR);
+	if (outfd < 0)
+		return -1;
+
+	ret = fstat(outfd, &os);
+	if (ret || (size_t)os.st_size != size ||
+	    (os.st_dev == s->st_dev && os.st_ino == s->st_ino)) {
+		close(outfd);
+		return -1;
+	}
+
+	/* What the image looks like before the header is added */
+	expected = calloc(1, size);
+	if (!expected) {
+		close(outfd);
+		return -1;
+	}
+	if (add_barebox_header)
+		memcpy(expected, bb_header, sizeof(bb_header));
+	if (pread(fd, expected + addsize, s->st_size, 0) != s->st_size) {
+		free(expected);
+		close(outfd);
+		return -1;
+	}
+
+	/* Only the pages holding the header area and the CRC are written */
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, outfd, 0);
+	if (buf == MAP_FAILED) {
+		free(expected);
+		close(outfd);
+		return -1;
+	}
+
+	if (memcmp(buf, expected, 0x40) ||
+	    memcmp(buf + HEADER_AREA, expected + HEADER_AREA,
+		   size - sizeof(uint32_t) - HEADER_AREA) ||
+	    ((struct socfpga_header *)(buf + 0x40))->validation_word[0] !=
+	    (VALIDATION_WORD & 0xff)) {
+		free(expected);
+		munmap(buf, size);
+		close(outfd);
+		return -1;
+	}
+
+	memcpy(old, buf, sizeof(old));
+	memcpy(buf + 0x40, expected + 0x40, sizeof(old) - 0x40);
+	free(expected);
+	ret = fill_socfpga_header(buf, size, start_addr, version);
+	if (ret) {
+		munmap(buf, size);
+		close(outfd);
+		return ret;
+	}
+
+	/* crc(old) ^ crc(new) only depends on old ^ new */
+	for (i = 0; i < sizeof(old); i++)
+		old[i] ^= buf[i];
+	diff = crc32(0, old, sizeof(old));
+	diff = crc32_shift(diff, size - sizeof(uint32_t) - sizeof(old));
+
+	crc = (uint32_t *)(buf + size - sizeof(uint32_t));
+	*crc ^= diff;
+
+	/* Stores through the mapping do not reliably update the mtime,
+	 * which make relies on. */
+	ret = munmap(buf, size);
+	if (!ret)
+		ret = futimens(outfd, NULL);
+	close(outfd);
+
+	return ret;
+}
+
+static void fail_outfile(const char *tmp, const char *msg)
 {
-	fprintf(stderr, "usage: %s [-hb] [-v version] <infile> -o <outfile>\n", prgname);
+	perror(msg);
+	unlink(tmp);
+	exit(1);
 }
 
-int main(int argc, char *argv[])
+static void make_image(const char *infile, const char *outfile,
+		       unsigned version, int start_addr, int addsize,
+		       int min_image_size)
 {
-	int opt, ret;
-	const char *outfile = NULL, *infile;
+	int ret;
 	struct stat s;
-	void *buf;
-	int fd;
-	int max_image_size, min_image_size = 80;
-	int addsize = 0, pad;
-	unsigned int version = 0;
+	void *buf, *in;
+	int fd, outfd;
+	int max_image_size;
+	int pad;
+	size_t size;
+	mode_t mask;
+	char *tmp;
 
-	while ((opt = getopt(argc, argv, "o:hbv:")) != -1) {
-		switch (opt) {
-		case 'v':
-			version = atoi(optarg);
-			if (version > 1) {
-				printf("Versions supported: 0 or 1\n");
-				usage(argv[0]);
-				exit(1);
-			}
-			break;
-		case 'b':
-			add_barebox_header = 1;
-			min_image_size = 0;
-			addsize = 512;
-			break;
-		case 'h':
-			usage(argv[0]);
-			exit(0);
-		case 'o':
-			outfile = optarg;
-			break;
-		default:
-			usage(argv[0]);
-			exit(1);
-		}
-	}
 	if (version == 0) {
 		max_image_size = MAX_V0IMAGE_SIZE;
 	} else {
@@ -303,13 +505,16 @@ int main(int argc, char *argv[])
 	}
 	max_image_size -= addsize;
 
-	if (optind == argc || !outfile) {
-		usage(argv[0]);
+	if (start_addr < 0)
+		start_addr = addsize;
+
+	fd = open(infile, O_RDONLY);
+	if (fd == -1) {
+		perror("open infile");
 		exit(1);
 	}
-	infile = argv[optind];
 
-	ret = stat(infile, &s);
+	ret = fstat(fd, &s);
 	if (ret) {
 		perror("stat");
 		exit(1);
@@ -327,50 +532,331 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	fd = open(infile, O_RDONLY);
-	if (fd == -1) {
-		perror("open infile");
-		exit(1);
-	}
-
 	pad = s.st_size & 0x3;
 	if (pad)
 		pad = 4 - pad;
 
-	buf = calloc(s.st_size + 4 + addsize + pad, 1);
-	if (!buf) {
-		perror("malloc");
+	size = s.st_size + 4 + addsize + pad;
+
+	if ((start_addr & 0x3) || (size_t)start_addr >= size) {
+		fprintf(stderr, "invalid start address 0x%x\n", start_addr);
 		exit(1);
 	}
 
-	ret = read_full(fd, buf + addsize, s.st_size);
-	if (ret < 0) {
-		perror("read infile");
+	if (update_header &&
+	    !rewrite_socfpga_header(fd, &s, outfile, size, addsize, start_addr,
+				    version)) {
+		close(fd);
+		return;
+	}
+
+	/* The image is generated in a temporary file, which only replaces
+	 * outfile once complete: a failure neither leaves a truncated
+	 * outfile behind, nor destroys the input when converting in place. */
+	tmp = malloc(strlen(outfile) + sizeof(".XXXXXX"));
+	if (!tmp) {
+		perror("malloc");
+		exit(1);
+	}
+	sprintf(tmp, "%s.XXXXXX", outfile);
+	outfd = mkstemp(tmp);
+	if (outfd < 0) {
+		perror("open outfile");
 		exit(1);
 	}
 
+	mask = umask(0);
+	umask(mask);
+	if (fchmod(outfd, 0644 & ~mask))
+		fail_outfile(tmp, "chmod outfile");
+
+	/* Allocated upfront, so that running out of space is an error
+	 * here rather than a SIGBUS when writing through the mapping */
+	ret = posix_fallocate(outfd, 0, size);
+	if (ret) {
+		errno = ret;
+		fail_outfile(tmp, "write outfile");
+	}
+
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, outfd, 0);
+	if (buf == MAP_FAILED)
+		fail_outfile(tmp, "mmap outfile");
+
+	if (s.st_size) {
+		in = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (in == MAP_FAILED)
+			fail_outfile(tmp, "mmap infile");
+		memcpy(buf + addsize, in, s.st_size);
+		munmap(in, s.st_size);
+	}
 	close(fd);
 
 	if (add_barebox_header) {
 		memcpy(buf, bb_header, sizeof(bb_header));
 	}
 
-	ret = add_socfpga_header(buf, s.st_size + 4 + addsize + pad, addsize,
-	                         version);
-	if (ret)
+	ret = add_socfpga_header(buf, size, start_addr, version);
+	if (ret) {
+		unlink(tmp);
 		exit(1);
+	}
 
-	fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-	if (fd < 0) {
-		perror("open outfile");
+	ret = munmap(buf, size);
+	if (ret)
+		fail_outfile(tmp, "munmap outfile");
+
+	ret = futimens(outfd, NULL);
+	if (ret)
+		fail_outfile(tmp, "touch outfile");
+
+	ret = close(outfd);
+	if (ret)
+		fail_outfile(tmp, "write outfile");
+
+	ret = rename(tmp, outfile);
+	if (ret)
+		fail_outfile(tmp, "rename outfile");
+	free(tmp);
+}
+
+struct manifest_entry {
+	char *infile;
+	char *outfile;
+	char *path;	/* outfile, with its directory resolved */
+	unsigned version;
+	int start_addr;
+};
+
+/* outfile may not exist yet, so only its directory is resolved */
+static char *resolve_outfile(const char *outfile)
+{
+	char *copy, *dir, *path;
+
+	copy = strdup(outfile);
+	if (!copy) {
+		perror("malloc");
+		exit(1);
+	}
+	dir = realpath(dirname(copy), NULL);
+	free(copy);
+	if (!dir)
+		return strdup(outfile);
+
+	copy = strdup(outfile);
+	path = malloc(strlen(dir) + strlen(outfile) + 2);
+	if (!copy || !path) {
+		perror("malloc");
 		exit(1);
 	}
+	sprintf(path, "%s/%s", dir, basename(copy));
+	free(copy);
+	free(dir);
+	return path;
+}
+
+/* Each manifest line is "<infile> <outfile> <version> [<start address>]".
+ * Empty lines and lines starting with '#' are ignored. The whole manifest
+ * is parsed before forking, then every image is generated in its own
+ * process, up to jobs at a time. */
+static int run_manifest(const char *manifest, int jobs, int addsize,
+			int min_image_size)
+{
+	char *line = NULL, *infile, *outfile, *version, *start, *end;
+	struct manifest_entry *entries = NULL, *e;
+	size_t len = 0, n = 0, i, j;
+	int running = 0, failed = 0, dups = 0, lineno = 0, status;
+	long start_addr;
+	unsigned long v;
+	pid_t pid;
+	FILE *f;
+
+	f = fopen(manifest, "r");
+	if (!f) {
+		perror("open manifest");
+		return 1;
+	}
+
+	while (getline(&line, &len, f) != -1) {
+		lineno++;
+		infile = strtok(line, " \t\n");
+		if (!infile || infile[0] == '#')
+			continue;
+		outfile = strtok(NULL, " \t\n");
+		version = strtok(NULL, " \t\n");
+		start = strtok(NULL, " \t\n");
+		if (!outfile || !version) {
+			fprintf(stderr, "%s:%d: missing fields\n", manifest, lineno);
+			failed++;
+			continue;
+		}
+
+		v = strtoul(version, &end, 0);
+		if (*end || v > 1) {
+			fprintf(stderr, "%s:%d: versions supported: 0 or 1\n",
+				manifest, lineno);
+			failed++;
+			continue;
+		}
+
+		start_addr = -1;
+		if (start) {
+			start_addr = strtol(start, &end, 0);
+			if (*end || start_addr < 0 || start_addr > MAX_V1IMAGE_SIZE) {
+				fprintf(stderr, "%s:%d: invalid start address\n",
+					manifest, lineno);
+				failed++;
+				continue;
+			}
+		}
+
+		e = realloc(entries, (n + 1) * sizeof(*entries));
+		if (!e) {
+			perror("malloc");
+			exit(1);
+		}
+		entries = e;
+		entries[n].infile = strdup(infile);
+		entries[n].outfile = strdup(outfile);
+		entries[n].path = resolve_outfile(outfile);
+		if (!entries[n].infile || !entries[n].outfile ||
+		    !entries[n].path) {
+			perror("malloc");
+			exit(1);
+		}
+		entries[n].version = v;
+		entries[n].start_addr = start_addr;
+		n++;
+	}
+
+	free(line);
+	fclose(f);
+
+	/* Entries with the same outfile would race on it */
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < i; j++) {
+			if (!strcmp(entries[i].path, entries[j].path)) {
+				fprintf(stderr, "%s: %s: duplicate outfile\n",
+					manifest, entries[i].outfile);
+				dups++;
+				break;
+			}
+		}
+	}
+	failed += dups;
+
+	for (i = 0; !dups && i < n; i++) {
+		if (running == jobs) {
+			if (wait(&status) > 0 &&
+			    (!WIFEXITED(status) || WEXITSTATUS(status)))
+				failed++;
+			running--;
+		}
+
+		fflush(NULL);
+		pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			failed += n - i;
+			break;
+		}
+		if (pid == 0) {
+			make_image(entries[i].infile, entries[i].outfile,
+				   entries[i].version, entries[i].start_addr,
+				   addsize, min_image_size);
+			exit(0);
+		}
+		running++;
+	}
+
+	while (running--) {
+		if (wait(&status) > 0 &&
+		    (!WIFEXITED(status) || WEXITSTATUS(status)))
+			failed++;
+	}
+
+	for (i = 0; i < n; i++) {
+		free(entries[i].infile);
+		free(entries[i].outfile);
+		free(entries[i].path);
+	}
+	free(entries);
+
+	if (failed)
+		fprintf(stderr, "%s: %d image(s) failed\n", manifest, failed);
+
+	return failed ? 1 : 0;
+}
+
+static void usage(const char *prgname)
+{
+	fprintf(stderr, "usage: %s [-hbu] [-v version] <infile> -o <outfile>\n", prgname);
+	fprintf(stderr, "       %s [-bu] [-j jobs] -m <manifest>\n", prgname);
+	fprintf(stderr, "       %s -t\n", prgname);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	const char *outfile = NULL, *manifest = NULL;
+	int min_image_size = 80;
+	int addsize = 0;
+	int jobs = 0;
+	unsigned int version = 0;
+
+	crc32_init();
+
+	while ((opt = getopt(argc, argv, "o:hbtuv:m:j:")) != -1) {
+		switch (opt) {
+		case 'v':
+			version = atoi(optarg);
+			if (version > 1) {
+				printf("Versions supported: 0 or 1\n");
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'b':
+			add_barebox_header = 1;
+			min_image_size = 0;
+			addsize = 512;
+			break;
+		case 't':
+			exit(crc32_selftest() ? 1 : 0);
+		case 'u':
+			update_header = 1;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(0);
+		case 'o':
+			outfile = optarg;
+			break;
+		case 'm':
+			manifest = optarg;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+
+	if (manifest) {
+		if (jobs <= 0)
+			jobs = sysconf(_SC_NPROCESSORS_ONLN);
+		if (jobs <= 0)
+			jobs = 1;
+		exit(run_manifest(manifest, jobs, addsize, min_image_size));
+	}
 
-	ret = write_full(fd, buf, s.st_size + 4 + addsize + pad);
-	if (ret < 0) {
-		perror("write outfile");
+	if (optind == argc || !outfile) {
+		usage(argv[0]);
 		exit(1);
 	}
 
+	make_image(argv[optind], outfile, version, -1, addsize, min_image_size);
+
 	exit(0);
 }
@@ -47,14 +47,25 @@ endef
 #######################################
 # Actual steps hooks
 
-# Time steps
+# Time steps, and record the resources used by make's children. When
+# the step runs in step-shell, make is not the parent of the shell.
 define step_time
-	printf "%s:%-5.5s:%-20.20s: %s\n"           \
-	       "$$(date +%s.%N)" "$(1)" "$(2)" "$(3)"  \
-	       >>"$(BUILD_DIR)/build-time.log"
+	$(STEP_LOG) record "$(BUILD_DIR)/build-time.bin" "$(1)" "$(2)" "$(3)" \
+		$${STEP_LOG_PID:-$$PPID}
 endef
 GLOBAL_INSTRUMENTATION_HOOKS += step_time
 
+# Shell recording the resources used by each command of a step
+# $(1): step name
+# $(2): package name
+step-shell = $(STEP_LOG) run $(BUILD_DIR)/build-time.bin $(1) $(2) $(CONFIG_SHELL)
+
+# The helper is only built by prepare, which the steps depend on: the
+# targets needed before must not inherit step-shell from them.
+ifeq ($(BR2_RECORD_RESOURCE_USAGE),y)
+prepare dependencies: SHELL = $(CONFIG_SHELL)
+endif
+
 # This hook checks that host packages that need libraries that we build
 # have a proper DT_RPATH or DT_RUNPATH tag
 define check_host_rpath
@@ -90,20 +101,48 @@ endif
 #######################################
 # Helper functions
 
+# Some packages have messed up permissions inside their archive, so make
+# everything readable and writable. Walking the whole tree is expensive
+# for big packages (e.g. the 80k files of linux), so when the archive
+# was extracted with a listing of its entries (see the default extract
+# command), only do it if an entry does lack one of those permissions.
+# $(1): extracted directory
+# $(2): listing of the extracted entries, as output by 'tar -vv', if any
+define extract-fixup-permissions
+	if [ -z "$(2)" ] || [ ! -e "$(2)" ] || \
+		awk -v umask=$$(umask) ' \
+			BEGIN { \
+				for (i = 0; i < 3; i++) { \
+					d = substr(umask, length(umask) - 2 + i, 1); \
+					r[i] = int(d / 4) % 2 == 0; w[i] = int(d / 2) % 2 == 0; \
+				} \
+			} \
+			substr($$1, 1, 1) != "l" { \
+				for (i = 0; i < 3; i++) \
+					if ((r[i] && substr($$1, 2 + 3 * i, 1) != "r") || \
+					    (w[i] && substr($$1, 3 + 3 * i, 1) != "w")) { \
+						found = 1; exit; \
+					} \
+			} \
+			END { exit !found }' $(2); then \
+		chmod -R +rw $(1); \
+	fi; \
+	rm -f $(2)
+endef
+
 ifeq ($(BR2_PER_PACKAGE_DIRECTORIES),y)
 
 # Ensure files like .la, .pc, .pri, .cmake, and so on, point to the
 # proper staging and host directories for the current package: find
 # all text files that contain the PPD root, and replace it with the
-# current package's PPD.
+# current package's PPD. The files the dependencies already looked at
+# are recorded in their .ppd-fixup-index, and not scanned again.
 define PPD_FIXUP_PATHS
-	$(Q)grep --binary-files=without-match -lrZ '$(PER_PACKAGE_DIR)/[^/]\+/' $(HOST_DIR) \
-	|while read -d '' f; do \
-		file -b --mime-type "$${f}" | grep -q '^text/' || continue; \
-		printf '%s\0' "$${f}"; \
-	done \
-	|xargs -0 --no-run-if-empty \
-		$(SED) 's:$(PER_PACKAGE_DIR)/[^/]\+/:$(PER_PACKAGE_DIR)/$($(PKG)_NAME)/:g'
+	$(Q)$(PPD_FIXUP) -p $(PER_PACKAGE_DIR) -n $($(PKG)_NAME) \
+		$(foreach p,$($(PKG)_FINAL_DEPENDENCIES),\
+			-i $(PER_PACKAGE_DIR)/$(p)/.ppd-fixup-index) \
+		-o $(PER_PACKAGE_DIR)/$($(PKG)_NAME)/.ppd-fixup-index \
+		$(HOST_DIR)
 endef
 
 # Remove python's pre-compiled "sysconfigdata", as it may contain paths to
@@ -152,13 +191,41 @@ define pkg_size_after
 endef
 
 define check_bin_arch
-	support/scripts/check-bin-arch -p $($(PKG)_NAME) \
+	$(CHECK_BIN_ARCH) -p $($(PKG)_NAME) \
 		-l $($(PKG)_DIR)/.files-list.txt \
 		$(foreach i,$($(PKG)_BIN_ARCH_EXCLUDE),-i "$(i)") \
 		-r $(TARGET_READELF) \
 		-a $(BR2_READELF_ARCH_NAME)
 endef
 
+# Finalize the target files of the package in its own target directory,
+# like target-finalize does for the whole target directory. The ELF
+# files are then recorded as finalized, for target-finalize to skip
+# them, except the ones whose RPATH could not be sanitized in place,
+# which are left to patchelf, in target-finalize.
+ifeq ($(BR2_PER_PACKAGE_FINALIZE),y)
+define finalize_target
+	$(FINALIZE_TARGET) $(FINALIZE_TARGET_ARGS) $(FINALIZE_TARGET_KEY) \
+		-f $($(PKG)_DIR)/.files-list.txt \
+		-c $(PER_PACKAGE_DIR)/$($(PKG)_NAME)/.finalize-cache \
+		-e $($(PKG)_DIR)/.finalize-elf-files.list \
+		$(TARGET_DIR)
+	$(if $(BR2_STRIP_strip),$(STRIP_TREE) $(STRIP_TREE_ARGS) \
+		-L $($(PKG)_DIR)/.finalize-elf-files.list \
+		$(TARGET_DIR) $(STRIPCMD))
+	$(SANITIZE_RPATH) $(SANITIZE_RPATH_TARGET_ARGS) \
+		-L $($(PKG)_DIR)/.finalize-elf-files.list \
+		$(TARGET_DIR) >$($(PKG)_DIR)/.finalize-patchelf.list
+	$(FINALIZE_TARGET) $(FINALIZE_TARGET_KEY) \
+		-c $(PER_PACKAGE_DIR)/$($(PKG)_NAME)/.finalize-cache \
+		-U $($(PKG)_DIR)/.finalize-elf-files.list \
+		-X $($(PKG)_DIR)/.finalize-patchelf.list \
+		$(TARGET_DIR)
+	rm -f $($(PKG)_DIR)/.finalize-elf-files.list \
+		$($(PKG)_DIR)/.finalize-patchelf.list
+endef
+endif
+
 # Functions to remove conflicting and useless files
 
 # $1: base directory (target, staging, host)
@@ -215,8 +282,7 @@ $(BUILD_DIR)/%/.stamp_extracted:
 	$(foreach hook,$($(PKG)_PRE_EXTRACT_HOOKS),$(call $(hook))$(sep))
 	$(Q)mkdir -p $(@D)
 	$($(PKG)_EXTRACT_CMDS)
-# some packages have messed up permissions inside
-	$(Q)chmod -R +rw $(@D)
+	$(Q)$(call extract-fixup-permissions,$(@D),$($(PKG)_EXTRACT_LISTING))
 	$(foreach hook,$($(PKG)_POST_EXTRACT_HOOKS),$(call $(hook))$(sep))
 	@$(call step_end,extract)
 	$(Q)touch $@
@@ -404,6 +470,7 @@ $(BUILD_DIR)/%/.stamp_installed:
 	@$(call pkg_size_after,$(BINARIES_DIR),-images)
 	@$(call pkg_size_after,$(HOST_DIR),-host)
 	@$(call check_bin_arch)
+	$(if $(filter target,$($(PKG)_TYPE)),$(finalize_target))
 	$(Q)touch $@
 
 # Remove package sources
@@ -853,13 +920,18 @@ $(2)_TARGET_SOURCE =		$$($(2)_DIR)/.stamp_downloaded
 $(2)_TARGET_ACTUAL_SOURCE =	$$($(2)_DIR)/.stamp_actual_downloaded
 $(2)_TARGET_DIRCLEAN =		$$($(2)_DIR)/.stamp_dircleaned
 
-# default extract command
-$(2)_EXTRACT_CMDS ?= \
+# default extract command; tar also lists the extracted entries, for
+# extract-fixup-permissions
+ifeq ($$(origin $(2)_EXTRACT_CMDS),undefined)
+$(2)_EXTRACT_LISTING = $$($(2)_DIR)/.br_extract_listing
+$(2)_EXTRACT_CMDS = \
 	$$(if $$($(2)_SOURCE),$$(INFLATE$$(suffix $$($(2)_SOURCE))) $$($(2)_DL_DIR)/$$($(2)_SOURCE) | \
 	$$(TAR) --strip-components=$$($(2)_STRIP_COMPONENTS) \
 		-C $$($(2)_DIR) \
+		-vv --index-file=$$($(2)_EXTRACT_LISTING) \
 		$$(foreach x,$$($(2)_EXCLUDES),--exclude='$$(x)' ) \
 		$$(TAR_OPTIONS) -)
+endif
 
 # pre/post-steps hooks
 $(2)_POST_PREPARE_HOOKS += \
@@ -940,7 +1012,7 @@ $$($(2)_TARGET_BUILD):	$$($(2)_TARGET_CONFIGURE)
 # dependency by using |.
 
 $(1)-configure:			$$($(2)_TARGET_CONFIGURE)
-$$($(2)_TARGET_CONFIGURE):	| $$($(2)_FINAL_DEPENDENCIES)
+$$($(2)_TARGET_CONFIGURE):	| $$(call build-order,$$($(2)_FINAL_DEPENDENCIES))
 
 $$($(2)_TARGET_SOURCE) $$($(2)_TARGET_RSYNC): | prepare
 $$($(2)_TARGET_SOURCE) $$($(2)_TARGET_RSYNC): | dependencies
@@ -1092,6 +1164,18 @@ $$($(2)_TARGET_ACTUAL_SOURCE):		PKGDIR=$(pkgdir)
 $$($(2)_TARGET_DIRCLEAN):		PKG=$(2)
 $$($(2)_TARGET_DIRCLEAN):		NAME=$(1)
 
+ifeq ($$(BR2_RECORD_RESOURCE_USAGE),y)
+$$($(2)_TARGET_INSTALL_TARGET):		SHELL=$$(call step-shell,install-target,$(1))
+$$($(2)_TARGET_INSTALL_STAGING):	SHELL=$$(call step-shell,install-staging,$(1))
+$$($(2)_TARGET_INSTALL_IMAGES):		SHELL=$$(call step-shell,install-image,$(1))
+$$($(2)_TARGET_INSTALL_HOST):		SHELL=$$(call step-shell,install-host,$(1))
+$$($(2)_TARGET_BUILD):			SHELL=$$(call step-shell,build,$(1))
+$$($(2)_TARGET_CONFIGURE):		SHELL=$$(call step-shell,configure,$(1))
+$$($(2)_TARGET_RSYNC):			SHELL=$$(call step-shell,rsync,$(1))
+$$($(2)_TARGET_PATCH):			SHELL=$$(call step-shell,patch,$(1))
+$$($(2)_TARGET_EXTRACT):		SHELL=$$(call step-shell,extract,$(1))
+endif
+
 # Compute the name of the Kconfig option that correspond to the
 # package being enabled.
 ifeq ($(1),linux)
@@ -20,7 +20,7 @@
 #
 ################################################################################
 
-WAF_OPTS = $(if $(VERBOSE),-v) -j $(PARALLEL_JOBS)
+WAF_OPTS = $(if $(VERBOSE),-v) -j $(JOB_BUDGET_JOBS)
 
 ################################################################################
 # inner-waf-package -- defines how the configuration, compilation and
@@ -82,8 +82,9 @@ endif
 #
 ifndef $(2)_BUILD_CMDS
 define $(2)_BUILD_CMDS
-	cd $$($$(PKG)_SRCDIR) && \
-	$$(TARGET_MAKE_ENV) $$($$(PKG)_MAKE_ENV) $$(HOST_DIR)/bin/python3 $$($(2)_WAF) \
+	+cd $$($$(PKG)_SRCDIR) && \
+	$$(TARGET_MAKE_ENV) $$($$(PKG)_MAKE_ENV) \
+		$$(JOB_BUDGET) $$(HOST_DIR)/bin/python3 $$($(2)_WAF) \
 		build $$(WAF_OPTS) $$($(2)_BUILD_OPTS) \
 		$$($(2)_WAF_OPTS)
 endef
@@ -0,0 +1,543 @@
+/**
+ * Check that the ELF files installed in the target directory are for
+ * the architecture of the target.
+ *
+ *   check-bin-arch -p PKG -l PKG-FILE-LIST -r READELF -a ARCH [-i PATH]...
+ *   check-bin-arch -t [-j JOBS] -r READELF -a ARCH [-i PATH]...
+ *
+ * The first form checks the files listed for PKG in PKG-FILE-LIST (the
+ * .files-list.txt of the package, with lines like 'PKG,./usr/bin/foo'),
+ * after the package is installed. The second form checks all the files
+ * of the target directory, with JOBS processes (by default, one per
+ * CPU). In both cases, the target directory is $TARGET_DIR.
+ *
+ * Only the ELF header of each file is read, or the one of the first ELF
+ * member of a static library, and its machine is compared to the one
+ * that readelf names ARCH (BR2_READELF_ARCH_NAME). READELF is only run
+ * for the machines that are not known here, to get their name.
+ *
+ * Symbolic links are skipped, as they may point to host files while
+ * building, and so are the files under the paths that may legitimately
+ * hold ELF files for other architectures (firmware, kernel modules...),
+ * plus the ones passed with -i.
+ *
+ * This file is licensed under the terms of the GNU General Public License
+ * version 2.  This program is licensed "as is" without any warranty of any
+ * kind, whether express or implied.
+ */
+
+#define _GNU_SOURCE
+#include <ar.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifndef EM_ARC_COMPACT
+#define EM_ARC_COMPACT		93
+#endif
+#ifndef EM_ARC_COMPACT2
+#define EM_ARC_COMPACT2		195
+#endif
+#ifndef EM_ALTERA_NIOS2
+#define EM_ALTERA_NIOS2		113
+#endif
+#ifndef EM_MICROBLAZE
+#define EM_MICROBLAZE		189
+#endif
+#ifndef EM_RISCV
+#define EM_RISCV		243
+#endif
+#define EM_MICROBLAZE_OLD	0xbaab
+
+/* Paths that may contain binaries for another architecture than the
+ * one of the target */
+static const char *const default_ignores[] = {
+	/* Skip firmware files, they could be ELF files for other
+	 * architectures */
+	"/lib/firmware",
+	"/usr/lib/firmware",
+
+	/* Skip kernel modules
+	 * When building a 32-bit userland on 64-bit architectures, the
+	 * kernel and its modules may still be 64-bit. To keep the basic
+	 * check-bin-arch logic simple, just skip this directory. */
+	"/lib/modules",
+	"/usr/lib/modules",
+
+	/* Skip files in /usr/share, several packages (qemu,
+	 * pru-software-support) legitimately install ELF binaries that
+	 * are not for the target architecture */
+	"/usr/share",
+
+	/* Skip files in {/usr,}/lib/grub, since it is possible to have
+	 * it for a different architecture (e.g. i386 grub on x86_64). */
+	"/lib/grub",
+	"/usr/lib/grub",
+
+	/* Guile modules are ELF files, with a "None" machine */
+	"/usr/lib/guile",
+};
+
+/* Names given by readelf to the machines of the supported
+ * architectures, see BR2_READELF_ARCH_NAME */
+static const struct {
+	uint16_t machine;
+	const char *name;
+} machines[] = {
+	{ EM_NONE,		"None" },
+	{ EM_SPARC,		"Sparc" },
+	{ EM_386,		"Intel 80386" },
+	{ EM_68K,		"MC68000" },
+	{ EM_MIPS,		"MIPS R3000" },
+	{ EM_SPARC32PLUS,	"Sparc v8+" },
+	{ EM_PPC,		"PowerPC" },
+	{ EM_PPC64,		"PowerPC64" },
+	{ EM_S390,		"IBM S/390" },
+	{ EM_ARM,		"ARM" },
+	{ EM_SH,		"Renesas / SuperH SH" },
+	{ EM_SPARCV9,		"Sparc v9" },
+	{ EM_X86_64,		"Advanced Micro Devices X86-64" },
+	{ EM_OPENRISC,		"OpenRISC 1000" },
+	{ EM_ARC_COMPACT,	"ARCompact" },
+	{ EM_XTENSA,		"Tensilica Xtensa Processor" },
+	{ EM_ALTERA_NIOS2,	"Altera Nios II" },
+	{ EM_AARCH64,		"AArch64" },
+	{ EM_MICROBLAZE,	"Xilinx MicroBlaze" },
+	{ EM_ARC_COMPACT2,	"ARCv2" },
+	{ EM_RISCV,		"RISC-V" },
+	{ EM_MICROBLAZE_OLD,	"Xilinx MicroBlaze" },
+};
+
+#define NMACHINES (sizeof(machines) / sizeof(machines[0]))
+
+/* Prefix tree of the ignored paths */
+struct trie {
+	struct trie *child, *sibling;
+	unsigned char c;
+	bool end;
+};
+
+static const char *progname, *target_dir, *readelf, *arch_name;
+static struct trie ignores;
+static int expected = -1;	/* machine, or -1 if unknown */
+
+static void *xmalloc(size_t size)
+{
+	void *p = calloc(1, size);
+
+	if (!p) {
+		perror(progname);
+		exit(1);
+	}
+	return p;
+}
+
+static void trie_add(struct trie *t, const char *s)
+{
+	struct trie *n;
+
+	for (; *s; s++) {
+		for (n = t->child; n && n->c != (unsigned char)*s; n = n->sibling)
+			;
+		if (!n) {
+			n = xmalloc(sizeof(*n));
+			n->c = *s;
+			n->sibling = t->child;
+			t->child = n;
+		}
+		t = n;
+	}
+	t->end = true;
+}
+
+static bool trie_prefix(const struct trie *t, const char *s)
+{
+	for (; *s; s++) {
+		for (t = t->child; t && t->c != (unsigned char)*s; t = t->sibling)
+			;
+		if (!t)
+			return false;
+		if (t->end)
+			return true;
+	}
+	return false;
+}
+
+/* Like the former shell script: single '/' separators, and a leading
+ * and a trailing one */
+static char *normalize(const char *path)
+{
+	char *out = xmalloc(strlen(path) + 3), *o = out;
+
+	*o++ = '/';
+	for (; *path; path++)
+		if (*path != '/' || o[-1] != '/')
+			*o++ = *path;
+	if (o[-1] != '/')
+		*o++ = '/';
+	*o = '\0';
+	return out;
+}
+
+/* Machine of an ELF header, or -1 if this is not one */
+static int elf_machine(const unsigned char *h, size_t len)
+{
+	if (len < EI_NIDENT + 4 || memcmp(h, ELFMAG, SELFMAG) ||
+	    (h[EI_CLASS] != ELFCLASS32 && h[EI_CLASS] != ELFCLASS64))
+		return -1;
+	/* e_machine follows the 16-bit e_type */
+	if (h[EI_DATA] == ELFDATA2LSB)
+		return h[EI_NIDENT + 2] | h[EI_NIDENT + 3] << 8;
+	if (h[EI_DATA] == ELFDATA2MSB)
+		return h[EI_NIDENT + 2] << 8 | h[EI_NIDENT + 3];
+	return -1;
+}
+
+/* Machine of the first ELF member of an archive, like readelf -h | head */
+static int ar_machine(int fd)
+{
+	unsigned char h[64];
+	char hdr[60], size[11];
+	off_t off = SARMAG;
+	ssize_t len;
+	int machine;
+
+	while (pread(fd, hdr, sizeof(hdr), off) == sizeof(hdr)) {
+		if (memcmp(hdr + 58, ARFMAG, 2))
+			return -1;
+		memcpy(size, hdr + 48, 10);
+		size[10] = '\0';
+		off += sizeof(hdr);
+		/* Symbol tables and long names table */
+		if (!(hdr[0] == '/' && (hdr[1] == ' ' || hdr[1] == '/' ||
+					!strncmp(hdr + 1, "SYM64/", 6))) &&
+		    strncmp(hdr, "__.SYMDEF", 9)) {
+			len = pread(fd, h, sizeof(h), off);
+			machine = elf_machine(h, len > 0 ? len : 0);
+			if (machine >= 0)
+				return machine;
+		}
+		off += (strtoull(size, NULL, 10) + 1) & ~1ULL;
+	}
+	return -1;
+}
+
+static int file_machine(const char *path)
+{
+	unsigned char h[64];
+	struct stat st;
+	ssize_t len;
+	int fd, machine = -1;
+
+	/* Symbolic links may point to host files while building */
+	if (lstat(path, &st) || !S_ISREG(st.st_mode))
+		return -1;
+	fd = open(path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+	if (fd < 0)
+		return -1;
+	len = pread(fd, h, sizeof(h), 0);
+	if (len >= SARMAG && !memcmp(h, ARMAG, SARMAG))
+		machine = ar_machine(fd);
+	else if (len > 0)
+		machine = elf_machine(h, len);
+	close(fd);
+	return machine;
+}
+
+/* Machine name printed by readelf for a file, or NULL */
+static char *readelf_machine(const char *path)
+{
+	char *line = NULL, *name = NULL;
+	size_t len = 0;
+	int pipefd[2], status;
+	FILE *f;
+	pid_t pid;
+
+	if (pipe(pipefd))
+		return NULL;
+	pid = fork();
+	if (pid < 0)
+		return NULL;
+	if (pid == 0) {
+		dup2(pipefd[1], STDOUT_FILENO);
+		dup2(pipefd[1], STDERR_FILENO);
+		close(pipefd[0]);
+		close(pipefd[1]);
+		setenv("LC_ALL", "C", 1);
+		execlp(readelf, readelf, "-h", path, (char *)NULL);
+		_exit(127);
+	}
+	close(pipefd[1]);
+	f = fdopen(pipefd[0], "r");
+	while (f && getline(&line, &len, f) > 0) {
+		if (!name && !strncmp(line, "  Machine:", 10)) {
+			char *s = line + 10;
+
+			s += strspn(s, " ");
+			s[strcspn(s, "\n")] = '\0';
+			name = strdup(s);
+		}
+	}
+	free(line);
+	if (f)
+		fclose(f);
+	waitpid(pid, &status, 0);
+	return name;
+}
+
+static const char *machine_name(int machine)
+{
+	size_t i;
+
+	for (i = 0; i < NMACHINES; i++)
+		if (machines[i].machine == machine)
+			return machines[i].name;
+	return NULL;
+}
+
+/* Check one file, given relative to the target directory. Returns the
+ * error message, or NULL if the file is fine. */
+static char *check(const char *file)
+{
+	char *path, *name, *msg = NULL;
+	int machine;
+
+	if (trie_prefix(&ignores, file))
+		return NULL;
+	if (asprintf(&path, "%s/%s", target_dir, file) < 0) {
+		perror(progname);
+		exit(1);
+	}
+	machine = file_machine(path);
+	if (machine < 0 || machine == expected) {
+		free(path);
+		return NULL;
+	}
+	name = machine_name(machine) && expected >= 0 ?
+		strdup(machine_name(machine)) : readelf_machine(path);
+	/* Named like readelf does when it does not know the machine */
+	if (!name && asprintf(&name, "<unknown>: 0x%x", machine) < 0)
+		name = NULL;
+	free(path);
+	if (name && strcmp(name, arch_name) &&
+	    asprintf(&msg, "ERROR: architecture for \"%s\" is \"%s\", should be \"%s\"\n",
+		     file, name, arch_name) < 0)
+		msg = NULL;
+	free(name);
+	return msg;
+}
+
+static int check_package(const char *package, const char *list)
+{
+	char *line = NULL, *prefix, *msg;
+	size_t len = 0, plen;
+	int ret = 0;
+	FILE *f;
+
+	f = fopen(list, "re");
+	if (!f) {
+		fprintf(stderr, "%s: %s: %s\n", progname, list, strerror(errno));
+		return 1;
+	}
+	if (asprintf(&prefix, "%s,.", package) < 0) {
+		perror(progname);
+		exit(1);
+	}
+	plen = strlen(prefix);
+	while (getline(&line, &len, f) > 0) {
+		line[strcspn(line, "\n")] = '\0';
+		if (strncmp(line, prefix, plen) || !line[plen])
+			continue;
+		msg = check(line + plen);
+		if (msg) {
+			fputs(msg, stdout);
+			free(msg);
+			ret = 1;
+		}
+	}
+	free(line);
+	free(prefix);
+	fclose(f);
+	return ret;
+}
+
+static char **files;
+static size_t nfiles, afiles;
+
+static int collect(const char *path, const struct stat *st, int type,
+		   struct FTW *ftw)
+{
+	(void)st;
+	(void)ftw;
+	if (type != FTW_F)
+		return 0;
+	if (nfiles == afiles) {
+		afiles = afiles ? 2 * afiles : 1024;
+		files = realloc(files, afiles * sizeof(*files));
+		if (!files) {
+			perror(progname);
+			exit(1);
+		}
+	}
+	files[nfiles++] = strdup(path + strlen(target_dir));
+	return 0;
+}
+
+static int path_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Each process checks every JOBS-th file, and reports the index of the
+ * failing ones so that the errors are printed in a stable order */
+static int check_tree(int jobs)
+{
+	char *msg, *line = NULL, **errors;
+	size_t i, len = 0;
+	int pipefd[2], j, ret = 0;
+	FILE *f;
+
+	if (nftw(target_dir, collect, 64, FTW_PHYS)) {
+		fprintf(stderr, "%s: %s: %s\n", progname, target_dir, strerror(errno));
+		return 1;
+	}
+	qsort(files, nfiles, sizeof(*files), path_cmp);
+	errors = xmalloc((nfiles ? nfiles : 1) * sizeof(*errors));
+
+	if (pipe(pipefd)) {
+		perror(progname);
+		return 1;
+	}
+	for (j = 0; j < jobs; j++) {
+		pid_t pid = fork();
+
+		if (pid < 0) {
+			perror(progname);
+			exit(1);
+		}
+		if (pid)
+			continue;
+		close(pipefd[0]);
+		f = fdopen(pipefd[1], "w");
+		for (i = j; i < nfiles; i += jobs) {
+			msg = check(files[i]);
+			if (msg) {
+				fprintf(f, "%zu %s", i, msg);
+				/* One line at a time, so they do not mix */
+				fflush(f);
+				free(msg);
+			}
+		}
+		fclose(f);
+		_exit(0);
+	}
+	close(pipefd[1]);
+	f = fdopen(pipefd[0], "r");
+	while (getline(&line, &len, f) > 0) {
+		char *end;
+
+		i = strtoul(line, &end, 10);
+		if (i < nfiles && *end == ' ')
+			errors[i] = strdup(end + 1);
+	}
+	free(line);
+	fclose(f);
+	while (wait(NULL) > 0)
+		;
+
+	for (i = 0; i < nfiles; i++) {
+		if (errors[i]) {
+			fputs(errors[i], stdout);
+			ret = 1;
+		}
+	}
+	return ret;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s -p <pkg> -l <pkg-file-list> -r <readelf> -a <arch name> [-i PATH ...]\n"
+		"       %s -t [-j <jobs>] -r <readelf> -a <arch name> [-i PATH ...]\n",
+		progname, progname);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *package = NULL, *list = NULL;
+	bool tree = false;
+	long jobs = 0;
+	size_t i;
+	int opt;
+
+	progname = argv[0];
+	for (i = 0; i < sizeof(default_ignores) / sizeof(default_ignores[0]); i++)
+		trie_add(&ignores, default_ignores[i]);
+
+	while ((opt = getopt(argc, argv, "p:l:r:a:i:tj:")) != -1) {
+		switch (opt) {
+		case 'p':
+			package = optarg;
+			break;
+		case 'l':
+			list = optarg;
+			break;
+		case 'r':
+			readelf = optarg;
+			break;
+		case 'a':
+			arch_name = optarg;
+			break;
+		case 'i':
+			trie_add(&ignores, normalize(optarg));
+			break;
+		case 't':
+			tree = true;
+			break;
+		case 'j':
+			jobs = strtol(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+		}
+	}
+	target_dir = getenv("TARGET_DIR");
+	if (optind != argc || !readelf || !arch_name || !target_dir ||
+	    (!tree && (!package || !list)))
+		usage();
+	/* The paths found in the tree are relative to it, with a leading
+	 * '/' like the ones of the file lists */
+	if (tree) {
+		char *dir = strdup(target_dir);
+
+		if (!dir) {
+			perror(progname);
+			return 1;
+		}
+		for (i = strlen(dir); i > 1 && dir[i - 1] == '/'; i--)
+			dir[i - 1] = '\0';
+		target_dir = dir;
+	}
+
+	/* Unknown names are compared to the output of readelf */
+	for (i = 0; i < NMACHINES; i++)
+		if (!strcmp(machines[i].name, arch_name))
+			expected = machines[i].machine;
+
+	if (!tree)
+		return check_package(package, list);
+	if (jobs <= 0)
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	fflush(stdout);
+	return check_tree(jobs > 0 ? jobs : 1);
+}
@@ -0,0 +1,599 @@
+/**
+ * Clean up the target directory, in a single walk of it.
+ *
+ *   finalize-target [-r PATH]... [-d DIR:PATTERN]... [-l LOCALE_DIR]...
+ *                   [-w LOCALE]... [-f PKG-FILE-LIST] [-c CACHE]...
+ *                   [-k KEY] [-e ELF-LIST] ROOTDIR
+ *   finalize-target [-k KEY] -c CACHE -U LIST [-X SKIP-LIST] ROOTDIR
+ *
+ *   -r  remove PATH, and what is below it
+ *   -d  remove the files below DIR named PATTERN (a shell pattern, like
+ *       for find's -name)
+ *   -l  remove the entries of LOCALE_DIR that are not one of the LOCALEs
+ *       (BR2_ENABLE_LOCALE_PURGE)
+ *   -e  write the paths of the ELF files left to ELF-LIST, separated by
+ *       NUL characters, for the steps that only deal with ELF files
+ *       (see strip-tree and sanitize-rpath)
+ *   -f  only process the files of a package, listed in PKG-FILE-LIST (its
+ *       .files-list.txt), rather than walking ROOTDIR
+ *   -c  do not list in ELF-LIST the files already finalized according
+ *       to CACHE
+ *   -k  only use the CACHEs recorded with the same KEY, e.g. the
+ *       arguments the files are stripped and sanitized with
+ *
+ * All the paths are relative to ROOTDIR.
+ *
+ * The second form records in CACHE that the files of LIST (an ELF-LIST,
+ * once stripped and with their RPATH sanitized) are finalized, except
+ * the ones listed in SKIP-LIST, one per line. A file is recognized as
+ * already finalized when it is the same inode as when it was recorded
+ * (e.g. hard-linked from a per-package directory), or has the same
+ * content.
+ *
+ * This file is licensed under the terms of the GNU General Public License
+ * version 2.  This program is licensed "as is" without any warranty of any
+ * kind, whether express or implied.
+ */
+
+#define _GNU_SOURCE
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <ftw.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char *progname, *root_dir;
+static size_t root_len;
+static FILE *elf_list;
+static int ret;
+
+struct list {
+	const char **items;
+	size_t n;
+};
+
+static void list_add(struct list *l, const char *item)
+{
+	l->items = realloc(l->items, (l->n + 1) * sizeof(*l->items));
+	if (!l->items || !item) {
+		perror(progname);
+		exit(1);
+	}
+	l->items[l->n++] = item;
+}
+
+static bool list_has(const struct list *l, const char *item)
+{
+	size_t i;
+
+	for (i = 0; i < l->n; i++)
+		if (!strcmp(l->items[i], item))
+			return true;
+	return false;
+}
+
+static struct list removed_paths, removed_names, locale_dirs, locales;
+
+/* Paths removed once the walk is done, so that it is not disturbed */
+static struct list to_remove;
+
+static int remove_one(const char *path, const struct stat *st, int type,
+		      struct FTW *ftw)
+{
+	(void)st;
+	(void)ftw;
+	if ((type == FTW_DP ? rmdir(path) : unlink(path)) && errno != ENOENT) {
+		fprintf(stderr, "%s: %s: %s\n", progname, path, strerror(errno));
+		ret = 1;
+	}
+	return 0;
+}
+
+/* Like rm -rf */
+static void remove_tree(const char *path)
+{
+	struct stat st;
+
+	if (lstat(path, &st))
+		return;
+	if (!S_ISDIR(st.st_mode))
+		remove_one(path, &st, FTW_F, NULL);
+	else
+		nftw(path, remove_one, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+/* Whether rel, relative to ROOTDIR, is in the directory dir */
+static bool is_below(const char *rel, const char *dir, size_t len)
+{
+	return !strncmp(rel, dir, len) && rel[len] == '/';
+}
+
+static bool is_elf(const char *path)
+{
+	unsigned char magic[SELFMAG];
+	bool elf;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+	if (fd < 0)
+		return false;
+	elf = read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+		!memcmp(magic, ELFMAG, SELFMAG);
+	close(fd);
+	return elf;
+}
+
+/*
+ * The files already finalized, with the hash of their content once
+ * finalized. The hash only has to tell whether a file was reinstalled
+ * since, it is not meant to resist collisions on purpose.
+ */
+struct entry {
+	char *path;
+	uint64_t hash;
+	long long size, mtime_sec, mtime_nsec;
+	unsigned long long dev, ino;
+};
+
+static struct entry *cache;
+static size_t ncache, acache;
+static uint64_t cache_key;
+
+static int cmp_entry(const void *a, const void *b)
+{
+	return strcmp(((const struct entry *)a)->path, ((const struct entry *)b)->path);
+}
+
+static void cache_add(const struct entry *e)
+{
+	if (ncache == acache) {
+		acache = acache ? 2 * acache : 1024;
+		cache = realloc(cache, acache * sizeof(*cache));
+		if (!cache) {
+			perror(progname);
+			exit(1);
+		}
+	}
+	cache[ncache++] = *e;
+}
+
+static void cache_read(const char *path)
+{
+	char *line = NULL;
+	size_t len = 0;
+	struct entry e;
+	ssize_t n;
+	FILE *f;
+	int off;
+
+	f = fopen(path, "r");
+	if (!f)
+		return;
+	/* Finalized in another way, or recorded without a key */
+	if (fscanf(f, "key %" SCNx64 "\n", &e.hash) != 1 || e.hash != cache_key) {
+		fclose(f);
+		return;
+	}
+	while ((n = getline(&line, &len, f)) > 0) {
+		if (line[n - 1] == '\n')
+			line[n - 1] = '\0';
+		if (sscanf(line, "%" SCNx64 " %lld %llu %llu %lld.%lld %n", &e.hash,
+			   &e.size, &e.dev, &e.ino, &e.mtime_sec, &e.mtime_nsec,
+			   &off) < 6 || !line[off])
+			continue;
+		e.path = strdup(line + off);
+		if (!e.path) {
+			perror(progname);
+			exit(1);
+		}
+		cache_add(&e);
+	}
+	free(line);
+	fclose(f);
+}
+
+static uint64_t hash_string(const char *s)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	for (; *s; s++)
+		h = (h ^ (unsigned char)*s) * 0x100000001b3ULL;
+	return h;
+}
+
+static uint64_t hash_file(const char *path, bool *ok)
+{
+	uint64_t h = 0xcbf29ce484222325ULL, w;
+	const unsigned char *map;
+	struct stat st;
+	size_t i;
+	int fd;
+
+	*ok = false;
+	fd = open(path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+	if (fd < 0)
+		return 0;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return 0;
+	}
+	if (!st.st_size) {
+		close(fd);
+		*ok = true;
+		return h;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+	for (i = 0; i + 8 <= (size_t)st.st_size; i += 8) {
+		memcpy(&w, map + i, 8);
+		h = ((h ^ w) * 0x100000001b3ULL);
+		h ^= h >> 29;
+	}
+	for (; i < (size_t)st.st_size; i++)
+		h = (h ^ map[i]) * 0x100000001b3ULL;
+	munmap((void *)map, st.st_size);
+	*ok = true;
+	return h ^ st.st_size;
+}
+
+static void entry_set(struct entry *e, const struct stat *st)
+{
+	e->size = st->st_size;
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->mtime_sec = st->st_mtim.tv_sec;
+	e->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+/* Whether the file is the one of the entry: the same inode, as
+ * hard-linked by the per-package rsync, or the same content */
+static bool entry_matches(const struct entry *e, const char *path,
+			  const struct stat *st)
+{
+	bool ok;
+
+	if (e->size != st->st_size)
+		return false;
+	if (e->dev == (unsigned long long)st->st_dev &&
+	    e->ino == (unsigned long long)st->st_ino &&
+	    e->mtime_sec == st->st_mtim.tv_sec &&
+	    e->mtime_nsec == st->st_mtim.tv_nsec)
+		return true;
+	return hash_file(path, &ok) == e->hash && ok;
+}
+
+static bool is_cached(const char *path, const char *rel, const struct stat *st)
+{
+	size_t lo = 0, hi = ncache;
+
+	/* First entry for rel, there may be several with several caches */
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if (strcmp(cache[mid].path, rel) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < ncache && !strcmp(cache[lo].path, rel); lo++)
+		if (entry_matches(&cache[lo], path, st))
+			return true;
+	return false;
+}
+
+static bool is_purged_locale(const char *rel)
+{
+	const char *entry;
+	size_t i, len;
+	char *name;
+	bool purged;
+
+	for (i = 0; i < locale_dirs.n; i++) {
+		len = strlen(locale_dirs.items[i]);
+		if (!is_below(rel, locale_dirs.items[i], len))
+			continue;
+		/* Not the hidden entries, like the shell loop used to */
+		entry = rel + len + 1;
+		if (entry[0] == '.')
+			return false;
+		name = strndup(entry, strcspn(entry, "/"));
+		if (!name) {
+			perror(progname);
+			exit(1);
+		}
+		purged = !list_has(&locales, name);
+		free(name);
+		return purged;
+	}
+	return false;
+}
+
+/* Anything but a directory */
+static void visit_file(const char *path, const char *rel, const char *name,
+		       const struct stat *st)
+{
+	size_t i;
+
+	for (i = 0; i < removed_names.n; i++) {
+		const char *rule = removed_names.items[i];
+		const char *pattern = strchr(rule, ':');
+
+		if (is_below(rel, rule, pattern - rule) &&
+		    !fnmatch(pattern + 1, name, 0)) {
+			list_add(&to_remove, strdup(path));
+			return;
+		}
+	}
+
+	if (elf_list && S_ISREG(st->st_mode) && is_elf(path) &&
+	    !is_cached(path, rel, st))
+		fprintf(elf_list, "%s%c", path, '\0');
+}
+
+static int visit(const char *path, const struct stat *st, int type,
+		 struct FTW *ftw)
+{
+	const char *rel = path + root_len + 1;
+
+	if (ftw->level == 0)
+		return FTW_CONTINUE;
+	if (is_purged_locale(rel)) {
+		list_add(&to_remove, strdup(path));
+		return type == FTW_D ? FTW_SKIP_SUBTREE : FTW_CONTINUE;
+	}
+	if (type != FTW_D)
+		visit_file(path, rel, path + ftw->base, st);
+	return FTW_CONTINUE;
+}
+
+/* Only the files of a package, rather than all the files of ROOTDIR */
+static int visit_file_list(const char *list)
+{
+	char *line = NULL, *path, *rel;
+	size_t len = 0, i;
+	struct stat st;
+	ssize_t n;
+	FILE *f;
+
+	f = fopen(list, "r");
+	if (!f)
+		return -1;
+	while ((n = getline(&line, &len, f)) > 0) {
+		if (line[n - 1] == '\n')
+			line[n - 1] = '\0';
+		rel = strchr(line, ',');
+		if (!rel)
+			continue;
+		rel++;
+		if (!strncmp(rel, "./", 2))
+			rel += 2;
+		if (asprintf(&path, "%s/%s", root_dir, rel) < 0) {
+			perror(progname);
+			exit(1);
+		}
+		rel = path + root_len + 1;
+		if (lstat(path, &st) || S_ISDIR(st.st_mode)) {
+			free(path);
+			continue;
+		}
+		for (i = 0; i < removed_paths.n; i++)
+			if (!strcmp(rel, removed_paths.items[i]) ||
+			    is_below(rel, removed_paths.items[i],
+				     strlen(removed_paths.items[i])))
+				break;
+		if (i < removed_paths.n || is_purged_locale(rel))
+			list_add(&to_remove, strdup(path));
+		else
+			visit_file(path, rel, strrchr(path, '/') + 1, &st);
+		free(path);
+	}
+	free(line);
+	fclose(f);
+	return 0;
+}
+
+/* Record the files of list, separated by NUL characters, as finalized,
+ * except the ones listed in skip, one per line */
+static int cache_update(const char *cache_path, const char *list, const char *skip)
+{
+	struct list skipped = { 0 };
+	size_t nold = ncache, len = 0, i;
+	char *line = NULL, *tmp;
+	struct entry e;
+	struct stat st;
+	ssize_t n;
+	bool ok;
+	FILE *f;
+
+	f = skip ? fopen(skip, "r") : NULL;
+	while (f && (n = getline(&line, &len, f)) > 0) {
+		if (line[n - 1] == '\n')
+			line[n - 1] = '\0';
+		list_add(&skipped, strdup(line));
+	}
+	if (f)
+		fclose(f);
+
+	/* The new entries are added after the old ones, which are then
+	 * only kept if not superseded and still matching their file */
+	f = fopen(list, "r");
+	if (!f)
+		return -1;
+	while (getdelim(&line, &len, '\0', f) > 0) {
+		if (strncmp(line, root_dir, root_len) || line[root_len] != '/' ||
+		    list_has(&skipped, line) || lstat(line, &st))
+			continue;
+		e.hash = hash_file(line, &ok);
+		if (!ok)
+			continue;
+		entry_set(&e, &st);
+		e.path = strdup(line + root_len + 1);
+		if (!e.path) {
+			perror(progname);
+			exit(1);
+		}
+		cache_add(&e);
+	}
+	free(line);
+	fclose(f);
+	qsort(cache + nold, ncache - nold, sizeof(*cache), cmp_entry);
+
+	if (asprintf(&tmp, "%s.tmp", cache_path) < 0)
+		return -1;
+	f = fopen(tmp, "w");
+	if (!f) {
+		free(tmp);
+		return -1;
+	}
+	fprintf(f, "key %016" PRIx64 "\n", cache_key);
+	for (i = 0; i < ncache; i++) {
+		char *path;
+
+		if (i < nold) {
+			if (bsearch(&cache[i], cache + nold, ncache - nold,
+				    sizeof(*cache), cmp_entry))
+				continue;
+			if (asprintf(&path, "%s/%s", root_dir, cache[i].path) < 0)
+				return -1;
+			ok = !lstat(path, &st) && entry_matches(&cache[i], path, &st);
+			free(path);
+			if (!ok)
+				continue;
+		}
+		fprintf(f, "%016" PRIx64 " %lld %llu %llu %lld.%09lld %s\n",
+			cache[i].hash, cache[i].size, cache[i].dev, cache[i].ino,
+			cache[i].mtime_sec, cache[i].mtime_nsec, cache[i].path);
+	}
+	if (fclose(f) || rename(tmp, cache_path)) {
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-r PATH]... [-d DIR:PATTERN]... [-l LOCALE_DIR]...\n"
+		"       [-w LOCALE]... [-f PKG-FILE-LIST] [-c CACHE]... [-k KEY]\n"
+		"       [-e ELF-LIST] ROOTDIR\n"
+		"       %s [-k KEY] -c CACHE -U LIST [-X SKIP-LIST] ROOTDIR\n",
+		progname, progname);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const char *elf_list_path = NULL, *file_list = NULL;
+	const char *update = NULL, *skip = NULL, *key = "";
+	struct list caches = { 0 };
+	char *path;
+	size_t i;
+	int opt;
+
+	progname = argv[0];
+	while ((opt = getopt(argc, argv, "r:d:l:w:f:c:k:e:U:X:")) != -1) {
+		switch (opt) {
+		case 'r':
+			list_add(&removed_paths, optarg);
+			break;
+		case 'd':
+			if (!strchr(optarg, ':'))
+				usage();
+			list_add(&removed_names, optarg);
+			break;
+		case 'l':
+			list_add(&locale_dirs, optarg);
+			break;
+		case 'w':
+			list_add(&locales, optarg);
+			break;
+		case 'f':
+			file_list = optarg;
+			break;
+		case 'c':
+			list_add(&caches, optarg);
+			break;
+		case 'k':
+			key = optarg;
+			break;
+		case 'e':
+			elf_list_path = optarg;
+			break;
+		case 'U':
+			update = optarg;
+			break;
+		case 'X':
+			skip = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1 || (update && caches.n != 1))
+		usage();
+	root_len = strlen(argv[optind]);
+	while (root_len > 1 && argv[optind][root_len - 1] == '/')
+		argv[optind][--root_len] = '\0';
+	root_dir = argv[optind];
+
+	cache_key = hash_string(key);
+	for (i = 0; i < caches.n; i++)
+		cache_read(caches.items[i]);
+	qsort(cache, ncache, sizeof(*cache), cmp_entry);
+
+	if (update) {
+		if (cache_update(caches.items[0], update, skip)) {
+			fprintf(stderr, "%s: %s: %s\n", progname, caches.items[0],
+				strerror(errno));
+			return 1;
+		}
+		return 0;
+	}
+
+	/* Not worth walking what is removed anyway. For a package, only
+	 * its files are removed, the ones of other packages may be there. */
+	for (i = 0; !file_list && i < removed_paths.n; i++) {
+		if (asprintf(&path, "%s/%s", root_dir, removed_paths.items[i]) < 0) {
+			perror(progname);
+			return 1;
+		}
+		remove_tree(path);
+		free(path);
+	}
+
+	if (elf_list_path) {
+		elf_list = fopen(elf_list_path, "w");
+		if (!elf_list) {
+			fprintf(stderr, "%s: %s: %s\n", progname, elf_list_path,
+				strerror(errno));
+			return 1;
+		}
+	}
+	if (file_list ? visit_file_list(file_list) :
+	    nftw(root_dir, visit, 64, FTW_PHYS | FTW_ACTIONRETVAL)) {
+		fprintf(stderr, "%s: %s: %s\n", progname, file_list ? file_list : root_dir,
+			strerror(errno));
+		return 1;
+	}
+	if (elf_list && fclose(elf_list)) {
+		fprintf(stderr, "%s: %s: %s\n", progname, elf_list_path, strerror(errno));
+		return 1;
+	}
+
+	for (i = 0; i < to_remove.n; i++)
+		remove_tree(to_remove.items[i]);
+	return ret;
+}
@@ -0,0 +1,247 @@
+/**
+ * Run a build tool that does not take part in the make jobserver (waf,
+ * go, ...) with as many jobs as the jobserver can give when it starts,
+ * rather than with the same fixed number of jobs for all the packages
+ * built at the same time (BR2_PER_PACKAGE_SCHEDULER).
+ *
+ *   job-budget MAX COMMAND ARGS...
+ *
+ * Each @JOBS@ in ARGS is replaced with the number of jobs: the one of
+ * the make job running the command, plus the job slots that could be
+ * taken from the jobserver without waiting, up to MAX in total. When
+ * there is no jobserver (e.g. make was not started with -j), MAX jobs
+ * are used. The slots are given back when the command exits.
+ *
+ * Both the pipe (--jobserver-fds, --jobserver-auth=R,W) and the named
+ * pipe (--jobserver-auth=fifo:PATH) jobservers are supported. Before
+ * make 4.4, the pipe is only inherited by the commands that make runs
+ * as recursive makes, so the commands are prefixed with '+'.
+ *
+ * This file is licensed under the terms of the GNU General Public License
+ * version 2.  This program is licensed "as is" without any warranty of any
+ * kind, whether express or implied.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define JOBS_PLACEHOLDER	"@JOBS@"
+
+static const char *progname;
+static pid_t child;
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: %s MAX COMMAND ARGS...\n", progname);
+	exit(2);
+}
+
+/* Only interrupts a blocking read() */
+static void on_alarm(int sig)
+{
+	(void)sig;
+}
+
+static void on_term(int sig)
+{
+	if (child > 0)
+		kill(child, sig);
+}
+
+static bool is_fifo(int fd)
+{
+	struct stat st;
+
+	return !fstat(fd, &st) && S_ISFIFO(st.st_mode);
+}
+
+/* Open the jobserver of the make running us, from MAKEFLAGS. The last
+ * option wins, as make appends its own to the ones it inherited. */
+static bool jobserver_open(int *rfd, int *wfd)
+{
+	const char *flags = getenv("MAKEFLAGS"), *opt = NULL, *p;
+	static const char *const names[] = {
+		"--jobserver-auth=", "--jobserver-fds=",
+	};
+	size_t i;
+
+	if (!flags)
+		return false;
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+		for (p = flags; (p = strstr(p, names[i])); p++)
+			if (!opt || p > opt)
+				opt = p + strlen(names[i]);
+	if (!opt)
+		return false;
+
+	if (!strncmp(opt, "fifo:", 5)) {
+		char *path = strndup(opt + 5, strcspn(opt + 5, " "));
+
+		if (!path)
+			return false;
+		/* Our own open file description, so non-blocking is ours */
+		*rfd = *wfd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		free(path);
+		return *rfd >= 0;
+	}
+	if (sscanf(opt, "%d,%d", rfd, wfd) != 2 || *rfd < 0 || *wfd < 0)
+		return false;
+	/* Not inherited if make did not consider us as a recursive make, in
+	 * which case the fds may as well be other files */
+	return is_fifo(*rfd) && is_fifo(*wfd);
+}
+
+/* Take one job slot without waiting. The pipe is shared with make and
+ * the other jobs, so it must stay blocking: if another job takes the
+ * slot between poll() and read(), the timer interrupts the read(). */
+static bool jobserver_take(int rfd, char *token)
+{
+	struct itimerval timer = { .it_value = { .tv_usec = 10000 } };
+	struct itimerval off = { { 0, 0 }, { 0, 0 } };
+	struct pollfd pfd = { .fd = rfd, .events = POLLIN };
+	ssize_t ret;
+
+	if (poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLIN))
+		return false;
+	setitimer(ITIMER_REAL, &timer, NULL);
+	ret = read(rfd, token, 1);
+	setitimer(ITIMER_REAL, &off, NULL);
+	return ret == 1;
+}
+
+static char *replace_jobs(const char *arg, const char *jobs)
+{
+	size_t plen = strlen(JOBS_PLACEHOLDER), jlen = strlen(jobs), n = 0;
+	const char *p;
+	char *out, *o;
+
+	for (p = arg; (p = strstr(p, JOBS_PLACEHOLDER)); p += plen)
+		n++;
+	if (!n)
+		return (char *)arg;
+	out = o = malloc(strlen(arg) + n * jlen + 1);
+	if (!out) {
+		perror(progname);
+		exit(1);
+	}
+	while ((p = strstr(arg, JOBS_PLACEHOLDER))) {
+		memcpy(o, arg, p - arg);
+		o += p - arg;
+		memcpy(o, jobs, jlen);
+		o += jlen;
+		arg = p + plen;
+	}
+	strcpy(o, arg);
+	return out;
+}
+
+int main(int argc, char **argv)
+{
+	struct sigaction sa, ign, oldint, oldquit;
+	char *tokens, jobs[24], *end;
+	int rfd, wfd, status, i;
+	long max, taken = 0;
+
+	progname = argv[0];
+	if (argc < 3)
+		usage();
+	max = strtol(argv[1], &end, 10);
+	if (*end || max < 1)
+		usage();
+
+	tokens = malloc(max);
+	if (!tokens) {
+		perror(progname);
+		return 1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_alarm;
+	sigaction(SIGALRM, &sa, NULL);
+
+	if (jobserver_open(&rfd, &wfd)) {
+		while (taken < max - 1 && jobserver_take(rfd, &tokens[taken]))
+			taken++;
+	} else {
+		rfd = wfd = -1;
+		taken = max - 1;
+	}
+	snprintf(jobs, sizeof(jobs), "%ld", taken + 1);
+	for (i = 3; i < argc; i++)
+		argv[i] = replace_jobs(argv[i], jobs);
+
+	/* Like system(), leave interrupting the command to the command,
+	 * but pass on the termination requests from make */
+	memset(&ign, 0, sizeof(ign));
+	ign.sa_handler = SIG_IGN;
+	sigaction(SIGINT, &ign, &oldint);
+	sigaction(SIGQUIT, &ign, &oldquit);
+	sa.sa_handler = on_term;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+
+	child = fork();
+	if (child < 0) {
+		perror(progname);
+		return 1;
+	}
+	if (child == 0) {
+		sigaction(SIGINT, &oldint, NULL);
+		sigaction(SIGQUIT, &oldquit, NULL);
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGHUP, SIG_DFL);
+		execvp(argv[2], argv + 2);
+		fprintf(stderr, "%s: %s: %s\n", progname, argv[2], strerror(errno));
+		_exit(127);
+	}
+	while (waitpid(child, &status, 0) < 0) {
+		if (errno != EINTR) {
+			perror(progname);
+			status = 1 << 8;
+			break;
+		}
+	}
+
+	/* Give back exactly the tokens that were taken */
+	if (wfd >= 0 && taken) {
+		const char *p = tokens;
+		ssize_t ret;
+
+		while (taken > 0) {
+			ret = write(wfd, p, taken);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret < 0) {
+				if (errno == EAGAIN) {
+					struct pollfd pfd = { .fd = wfd, .events = POLLOUT };
+
+					poll(&pfd, 1, -1);
+					continue;
+				}
+				perror(progname);
+				break;
+			}
+			p += ret;
+			taken -= ret;
+		}
+	}
+
+	if (WIFSIGNALED(status)) {
+		signal(WTERMSIG(status), SIG_DFL);
+		sigaction(SIGINT, &oldint, NULL);
+		sigaction(SIGQUIT, &oldquit, NULL);
+		raise(WTERMSIG(status));
+		return 128 + WTERMSIG(status);
+	}
+	return WEXITSTATUS(status);
+}
@@ -0,0 +1,379 @@
+/**
+ * Fix up the per-package directory paths in the text files of a
+ * per-package host directory.
+ *
+ *   ppd-fixup-paths -p PER_PACKAGE_DIR -n PKG [-i INDEX]... [-o INDEX]
+ *                   HOST_DIR
+ *
+ * The "PER_PACKAGE_DIR/<pkg>/" prefixes found in the text files of
+ * HOST_DIR are replaced by "PER_PACKAGE_DIR/PKG/". A file is text when
+ * it only has the characters file(1) accepts in text files. Rewritten
+ * files are replaced rather than modified, as they may be hard-linked
+ * from the per-package directory of another package.
+ *
+ *   -i  read INDEX, as written by -o for a dependency of PKG
+ *   -o  record in INDEX, for each file of HOST_DIR, whether it needs to
+ *       be fixed up
+ *
+ * A file recorded in an INDEX, with the same inode and modification
+ * time (e.g. hard-linked by the per-package rsync), is not scanned
+ * again: it is rewritten if it was to be fixed up, and left alone
+ * otherwise.
+ *
+ * This file is licensed under the terms of the GNU General Public License
+ * version 2.  This program is licensed "as is" without any warranty of any
+ * kind, whether express or implied.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <libgen.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char *progname, *root_dir;
+static size_t root_len;
+static char *needle, *repl;
+static size_t needle_len, repl_len;
+static FILE *index_out;
+static unsigned long scanned, skipped, rewritten;
+static int ret;
+
+struct entry {
+	char *path;
+	long long size, mtime_sec, mtime_nsec;
+	unsigned long long dev, ino;
+	int fixup;
+};
+
+static struct entry *entries;
+static size_t nentries, aentries;
+
+static int cmp_entry(const void *a, const void *b)
+{
+	return strcmp(((const struct entry *)a)->path, ((const struct entry *)b)->path);
+}
+
+static void index_read(const char *path)
+{
+	char *line = NULL;
+	size_t len = 0;
+	struct entry e;
+	ssize_t n;
+	FILE *f;
+	int off;
+
+	f = fopen(path, "r");
+	if (!f)
+		return;
+	while ((n = getline(&line, &len, f)) > 0) {
+		if (line[n - 1] == '\n')
+			line[n - 1] = '\0';
+		if (sscanf(line, "%d %lld %llu %llu %lld.%lld %n", &e.fixup,
+			   &e.size, &e.dev, &e.ino, &e.mtime_sec, &e.mtime_nsec,
+			   &off) < 6 || !line[off])
+			continue;
+		if (nentries == aentries) {
+			aentries = aentries ? 2 * aentries : 4096;
+			entries = realloc(entries, aentries * sizeof(*entries));
+			if (!entries) {
+				perror(progname);
+				exit(1);
+			}
+		}
+		e.path = strdup(line + off);
+		if (!e.path) {
+			perror(progname);
+			exit(1);
+		}
+		entries[nentries++] = e;
+	}
+	free(line);
+	fclose(f);
+}
+
+/* Whether the file was recorded by a dependency, and then whether it
+ * needs to be fixed up, without looking at its content */
+static int index_lookup(const char *rel, const struct stat *st)
+{
+	size_t lo = 0, hi = nentries;
+
+	/* First entry for rel, there may be several with several indexes */
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if (strcmp(entries[mid].path, rel) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < nentries && !strcmp(entries[lo].path, rel); lo++) {
+		const struct entry *e = &entries[lo];
+
+		if (e->size == st->st_size &&
+		    e->dev == (unsigned long long)st->st_dev &&
+		    e->ino == (unsigned long long)st->st_ino &&
+		    e->mtime_sec == st->st_mtim.tv_sec &&
+		    e->mtime_nsec == st->st_mtim.tv_nsec)
+			return e->fixup;
+	}
+	return -1;
+}
+
+/* The characters file(1) accepts in text files, be it ASCII, UTF-8 or
+ * ISO-8859: the NUL character, and most other control ones, are only
+ * found in binary files */
+static bool is_text(const unsigned char *buf, size_t len)
+{
+	static const unsigned int ctrl = 1 << 7 | 1 << 8 | 1 << '\t' |
+		1 << '\n' | 1 << '\f' | 1 << '\r' | 1 << 27;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if ((buf[i] < 32 && !(ctrl & (1U << buf[i]))) || buf[i] == 127)
+			return false;
+	return true;
+}
+
+/* Next "PER_PACKAGE_DIR/<pkg>/" prefix in buf, like the
+ * 's:PER_PACKAGE_DIR/[^/]\+/:' sed expression matches them, and its
+ * length in *len */
+static const char *find_prefix(const char *buf, const char *end, size_t *len)
+{
+	const char *p, *q;
+
+	while ((p = memmem(buf, end - buf, needle, needle_len))) {
+		for (q = p + needle_len; q < end && *q != '/' && *q != '\n'; q++)
+			;
+		if (q < end && *q == '/' && q > p + needle_len) {
+			*len = q + 1 - p;
+			return p;
+		}
+		buf = p + 1;
+	}
+	return NULL;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Replace path by a copy of buf with its prefixes fixed up, as sed -i
+ * does. Returns 0 when there was nothing to change. */
+static int fixup(const char *path, const char *buf, size_t size,
+		 const struct stat *st)
+{
+	const char *end = buf + size, *p, *start = buf;
+	char *tmp, *dir;
+	bool changed = false;
+	size_t len;
+	int fd;
+
+	for (p = find_prefix(buf, end, &len); p; p = find_prefix(buf, end, &len)) {
+		if (len != repl_len || memcmp(p, repl, len)) {
+			changed = true;
+			break;
+		}
+		buf = p + len;
+	}
+	if (!changed)
+		return 0;
+
+	dir = strdup(path);
+	if (!dir || asprintf(&tmp, "%s/.ppd-fixup.XXXXXX", dirname(dir)) < 0) {
+		perror(progname);
+		exit(1);
+	}
+	free(dir);
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		goto err;
+
+	buf = start;
+	while ((p = find_prefix(buf, end, &len))) {
+		if (write_all(fd, buf, p - buf) || write_all(fd, repl, repl_len))
+			goto err_unlink;
+		buf = p + len;
+	}
+	if (write_all(fd, buf, end - buf) ||
+	    fchmod(fd, st->st_mode & 07777) ||
+	    close(fd))
+		goto err_unlink_closed;
+	fd = -1;
+	if (rename(tmp, path))
+		goto err_unlink_closed;
+	free(tmp);
+	rewritten++;
+	return 1;
+
+err_unlink:
+	close(fd);
+err_unlink_closed:
+	unlink(tmp);
+err:
+	fprintf(stderr, "%s: %s: %s\n", progname, path, strerror(errno));
+	free(tmp);
+	ret = 1;
+	return -1;
+}
+
+static void index_write(const char *rel, const char *path, int fix)
+{
+	struct stat st;
+
+	/* A rewritten file is another inode */
+	if (!index_out || strchr(rel, '\n') || lstat(path, &st))
+		return;
+	fprintf(index_out, "%d %lld %llu %llu %lld.%09lld %s\n", fix,
+		(long long)st.st_size, (unsigned long long)st.st_dev,
+		(unsigned long long)st.st_ino, (long long)st.st_mtim.tv_sec,
+		(long long)st.st_mtim.tv_nsec, rel);
+}
+
+static int visit(const char *path, const struct stat *st, int type,
+		 struct FTW *ftw)
+{
+	const char *rel = path + root_len + 1, *map;
+	int fd, fix;
+
+	(void)ftw;
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return FTW_CONTINUE;
+
+	fix = index_lookup(rel, st);
+	if (!fix) {
+		skipped++;
+		index_write(rel, path, 0);
+		return FTW_CONTINUE;
+	}
+	if (!st->st_size) {
+		index_write(rel, path, 0);
+		return FTW_CONTINUE;
+	}
+
+	fd = open(path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+	if (fd < 0)
+		return FTW_CONTINUE;
+	map = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return FTW_CONTINUE;
+	if (fix < 0) {
+		scanned++;
+		fix = memmem(map, st->st_size, needle, needle_len) &&
+			is_text((const unsigned char *)map, st->st_size);
+	}
+	if (fix && fixup(path, map, st->st_size, st) < 0)
+		fix = -1;
+	munmap((void *)map, st->st_size);
+	if (fix >= 0)
+		index_write(rel, path, fix);
+	return FTW_CONTINUE;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s -p PER_PACKAGE_DIR -n PKG [-i INDEX]... [-o INDEX] HOST_DIR\n",
+		progname);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const char *ppd = NULL, *name = NULL, *index_path = NULL;
+	char *tmp = NULL;
+	size_t len;
+	int opt;
+
+	progname = argv[0];
+	while ((opt = getopt(argc, argv, "p:n:i:o:")) != -1) {
+		switch (opt) {
+		case 'p':
+			ppd = optarg;
+			break;
+		case 'n':
+			name = optarg;
+			break;
+		case 'i':
+			index_read(optarg);
+			break;
+		case 'o':
+			index_path = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (!ppd || !name || !*name || strchr(name, '/') || optind != argc - 1)
+		usage();
+
+	len = strlen(ppd);
+	while (len > 1 && ppd[len - 1] == '/')
+		len--;
+	if (asprintf(&needle, "%.*s/", (int)len, ppd) < 0 ||
+	    asprintf(&repl, "%s%s/", needle, name) < 0) {
+		perror(progname);
+		return 1;
+	}
+	needle_len = strlen(needle);
+	repl_len = strlen(repl);
+
+	root_len = strlen(argv[optind]);
+	while (root_len > 1 && argv[optind][root_len - 1] == '/')
+		argv[optind][--root_len] = '\0';
+	root_dir = argv[optind];
+
+	qsort(entries, nentries, sizeof(*entries), cmp_entry);
+
+	if (index_path) {
+		if (asprintf(&tmp, "%s.tmp", index_path) < 0) {
+			perror(progname);
+			return 1;
+		}
+		index_out = fopen(tmp, "w");
+		if (!index_out) {
+			fprintf(stderr, "%s: %s: %s\n", progname, tmp, strerror(errno));
+			return 1;
+		}
+	}
+
+	if (nftw(root_dir, visit, 64, FTW_PHYS | FTW_ACTIONRETVAL)) {
+		fprintf(stderr, "%s: %s: %s\n", progname, root_dir, strerror(errno));
+		ret = 1;
+	}
+
+	/* An incomplete index would only cost rescans, but keep the
+	 * previous one rather than recording a failed fix up */
+	if (index_out) {
+		if (fclose(index_out) || ret || rename(tmp, index_path)) {
+			unlink(tmp);
+			ret = ret ? ret : 1;
+		}
+		free(tmp);
+	}
+
+	fprintf(stderr, "%s: %lu files scanned, %lu skipped, %lu rewritten\n",
+		progname, scanned, skipped, rewritten);
+	return ret;
+}
@@ -0,0 +1,631 @@
+/**
+ * Sanitize the RPATH of the ELF files of a tree, like
+ *
+ *   patchelf --make-rpath-relative ROOTDIR [--relative-to-file]
+ *            [--no-standard-lib-dirs] FILE
+ *
+ * does with the Buildroot patch to patchelf, for all the files of the
+ * tree at once (see support/scripts/fix-rpath).
+ *
+ *   sanitize-rpath [-j JOBS] [-r] [-s] [-P PER_PACKAGE_DIR -H HOST_DIR]
+ *                  [-x PATH]... [-L LIST] ROOTDIR
+ *
+ *   -r  make the RPATH relative to the file ($ORIGIN), like
+ *       --relative-to-file
+ *   -s  drop ROOTDIR/lib and ROOTDIR/usr/lib, like --no-standard-lib-dirs
+ *   -P  first rewrite PER_PACKAGE_DIR/<pkg>/host to HOST_DIR
+ *   -x  do not process PATH, nor what is below it (like find -prune)
+ *   -L  only process the files listed in LIST, separated by NUL
+ *       characters (e.g. the ELF files found by finalize-target)
+ *
+ * Files are rejected by their ELF magic without being mapped. For the
+ * others, the RPATH (or RUNPATH) is read from the dynamic section, and
+ * when the new one is not longer, it is written in place of the old
+ * one, the rest of the old string being overwritten with 'X', and a
+ * DT_RPATH is converted to DT_RUNPATH, as patchelf does. The files for
+ * which the new RPATH is longer are left untouched, and printed on the
+ * standard output so that patchelf can handle them. A summary is
+ * printed on the standard error.
+ *
+ * This file is licensed under the terms of the GNU General Public License
+ * version 2.  This program is licensed "as is" without any warranty of any
+ * kind, whether express or implied.
+ */
+
+#define _GNU_SOURCE
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static const char *progname, *root_dir, *ppd_dir, *host_dir;
+static bool relative_to_file, no_standard_lib_dirs;
+static const char **excludes;
+static size_t nexcludes;
+
+enum {
+	STAT_SCANNED,
+	STAT_ELF,
+	STAT_REWRITTEN,
+	STAT_FALLBACK,
+	STAT_SKIPPED,
+	NSTATS,
+};
+
+static const char *const stat_names[NSTATS] = {
+	"files scanned", "with an RPATH", "rewritten",
+	"left to patchelf", "skipped",
+};
+
+/* Growable string */
+struct str {
+	char *s;
+	size_t len, alloc;
+};
+
+static void str_append(struct str *s, const char *p, size_t len)
+{
+	if (s->len + len + 1 > s->alloc) {
+		s->alloc = (s->len + len + 1) * 2;
+		s->s = realloc(s->s, s->alloc);
+		if (!s->s) {
+			perror(progname);
+			exit(1);
+		}
+	}
+	memcpy(s->s + s->len, p, len);
+	s->len += len;
+	s->s[s->len] = '\0';
+}
+
+static void str_add(struct str *s, const char *p)
+{
+	str_append(s, p, strlen(p));
+}
+
+/* Same as concatToRPath() in patchelf */
+static void concat_rpath(struct str *rpath, const char *path)
+{
+	if (rpath->len)
+		str_add(rpath, ":");
+	str_add(rpath, path);
+}
+
+/* Index of the first '/' of s from 1, like find_first_of('/', 1) */
+static size_t next_slash(const char *s, size_t from)
+{
+	const char *p;
+
+	if (from > strlen(s))
+		return SIZE_MAX;
+	p = strchr(s + from, '/');
+	return p ? (size_t)(p - s) : SIZE_MAX;
+}
+
+/* Same as makePathRelative() in patchelf: strip the leading components
+ * that path and ref have in common, then go up from what is left of
+ * ref. */
+static void make_path_relative(struct str *out, const char *path, const char *ref)
+{
+	const char *p = path, *r = ref;
+	size_t pos;
+
+	str_add(out, "$ORIGIN");
+	for (;;) {
+		pos = next_slash(p, 1);
+		if (next_slash(r, 1) != pos)
+			break;
+		if (pos == SIZE_MAX ? strcmp(p, r) : strncmp(p, r, pos))
+			break;
+		if (pos == SIZE_MAX)
+			break;
+		p += pos;
+		r += pos;
+	}
+	if (!strcmp(p, r))
+		return;
+	pos = 0;
+	do {
+		pos = next_slash(r, pos + 1);
+		str_add(out, "/..");
+	} while (pos != SIZE_MAX);
+	str_add(out, p);
+}
+
+/* One entry of the RPATH, handled like --make-rpath-relative does.
+ * Returns false if the whole file must be left alone. */
+static bool sanitize_dir(struct str *out, const char *dir, const char *file_dir)
+{
+	size_t root_len = strlen(root_dir);
+	char *path, *canonical;
+
+	if (!strncmp(dir, "$ORIGIN", 7)) {
+		if (asprintf(&path, "%s%s", file_dir, dir + 7) < 0)
+			return false;
+	} else if (!strncmp(dir, root_dir, root_len)) {
+		path = strdup(dir);
+	} else {
+		if (asprintf(&path, "%s%s", root_dir, dir) < 0)
+			return false;
+	}
+	if (!path)
+		return false;
+	canonical = realpath(path, NULL);
+	free(path);
+	/* Does not exist: dropped */
+	if (!canonical)
+		return true;
+
+	if (no_standard_lib_dirs &&
+	    !strncmp(canonical, root_dir, root_len) &&
+	    (!strcmp(canonical + root_len, "/lib") ||
+	     !strcmp(canonical + root_len, "/usr/lib"))) {
+		free(canonical);
+		return true;
+	}
+	if (relative_to_file) {
+		struct str rel = { 0 };
+
+		make_path_relative(&rel, canonical, file_dir);
+		concat_rpath(out, rel.s);
+		free(rel.s);
+	} else {
+		/* patchelf fails on such paths, the file is left unchanged */
+		if (strlen(canonical) < root_len) {
+			free(canonical);
+			return false;
+		}
+		concat_rpath(out, canonical + root_len);
+	}
+	free(canonical);
+	return true;
+}
+
+/* First PER_PACKAGE_DIR/<pkg>/host replaced with HOST_DIR, like the
+ * sed expression the script used to run */
+static char *rewrite_ppd(const char *rpath)
+{
+	size_t plen = strlen(ppd_dir), n;
+	const char *p, *comp;
+	struct str out = { 0 };
+
+	for (p = rpath; (p = strstr(p, ppd_dir)); p++) {
+		comp = p + plen;
+		if (*comp != '/')
+			continue;
+		n = strcspn(comp + 1, "/");
+		if (!n || strncmp(comp + 1 + n, "/host", 5))
+			continue;
+		str_append(&out, rpath, p - rpath);
+		str_add(&out, host_dir);
+		str_add(&out, comp + 1 + n + 5);
+		return out.s;
+	}
+	return strdup(rpath);
+}
+
+/* New RPATH of a file, or NULL if it must be left alone */
+static char *sanitize_rpath(const char *rpath, const char *file)
+{
+	char *dirs, *dir, *file_dir, *end;
+	struct str out = { 0 };
+	bool ok = true;
+
+	end = strrchr(file, '/');
+	file_dir = strndup(file, end ? (size_t)(end - file) : strlen(file));
+	dirs = ppd_dir ? rewrite_ppd(rpath) : strdup(rpath);
+	if (!file_dir || !dirs) {
+		perror(progname);
+		exit(1);
+	}
+	str_add(&out, "");
+	/* Split like std::getline(): a trailing ':' adds no entry */
+	for (dir = dirs; ok && *dir; dir = end) {
+		end = strchrnul(dir, ':');
+		if (*end)
+			*end++ = '\0';
+		ok = sanitize_dir(&out, dir, file_dir);
+	}
+	free(dirs);
+	free(file_dir);
+	if (!ok) {
+		free(out.s);
+		return NULL;
+	}
+	return out.s;
+}
+
+struct elf {
+	const unsigned char *map;
+	size_t size;
+	bool is64, msb;
+};
+
+static uint64_t rd(const struct elf *e, size_t off, int bytes)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < bytes; i++)
+		v |= (uint64_t)e->map[off + (e->msb ? bytes - 1 - i : i)] << (8 * i);
+	return v;
+}
+
+static void wr(const struct elf *e, unsigned char *buf, uint64_t v, int bytes)
+{
+	int i;
+
+	for (i = 0; i < bytes; i++)
+		buf[e->msb ? bytes - 1 - i : i] = v >> (8 * i);
+}
+
+struct section {
+	uint64_t offset, size;
+};
+
+/* Same checks as patchelf, which fails on the other files */
+static bool find_sections(const struct elf *e, struct section *dynamic,
+			  struct section *dynstr)
+{
+	uint64_t phoff, shoff, shnum, shstrndx, type;
+	size_t ehsize = e->is64 ? 64 : 52, shentsize = e->is64 ? 64 : 40;
+	uint64_t phentsize = e->is64 ? 56 : 32, phnum;
+	struct section shstr;
+	bool found_dynamic = false, found_dynstr = false;
+	uint64_t i;
+
+	if (e->size < ehsize)
+		return false;
+	type = rd(e, 16, 2);
+	if (type != ET_EXEC && type != ET_DYN)
+		return false;
+	phoff = rd(e, e->is64 ? 32 : 28, e->is64 ? 8 : 4);
+	shoff = rd(e, e->is64 ? 40 : 32, e->is64 ? 8 : 4);
+	if (rd(e, e->is64 ? 54 : 42, 2) != phentsize ||
+	    rd(e, e->is64 ? 58 : 46, 2) != shentsize)
+		return false;
+	phnum = rd(e, e->is64 ? 56 : 44, 2);
+	shnum = rd(e, e->is64 ? 60 : 48, 2);
+	shstrndx = rd(e, e->is64 ? 62 : 50, 2);
+	if (phoff > e->size || phnum * phentsize > e->size - phoff ||
+	    shoff > e->size || shnum * shentsize > e->size - shoff ||
+	    shstrndx >= shnum)
+		return false;
+
+#define SH(i, off32, off64, bytes32, bytes64) \
+	rd(e, shoff + (i) * shentsize + (e->is64 ? (off64) : (off32)), \
+	   e->is64 ? (bytes64) : (bytes32))
+	shstr.offset = SH(shstrndx, 16, 24, 4, 8);
+	shstr.size = SH(shstrndx, 20, 32, 4, 8);
+	if (shstr.offset > e->size || shstr.size > e->size - shstr.offset)
+		return false;
+	for (i = 0; i < shnum; i++) {
+		uint64_t name = SH(i, 0, 0, 4, 4);
+		const char *s;
+		struct section sec;
+
+		if (name >= shstr.size)
+			continue;
+		s = (const char *)e->map + shstr.offset + name;
+		if (!memchr(s, '\0', shstr.size - name))
+			continue;
+		sec.offset = SH(i, 16, 24, 4, 8);
+		sec.size = SH(i, 20, 32, 4, 8);
+		if (sec.offset > e->size || sec.size > e->size - sec.offset)
+			continue;
+		/* patchelf uses the first section with that name */
+		if (!found_dynamic && !strcmp(s, ".dynamic")) {
+			*dynamic = sec;
+			found_dynamic = true;
+		} else if (!found_dynstr && !strcmp(s, ".dynstr")) {
+			*dynstr = sec;
+			found_dynstr = true;
+		}
+	}
+#undef SH
+	return found_dynamic && found_dynstr;
+}
+
+/* Write the new RPATH in place, and convert DT_RPATH to DT_RUNPATH */
+static bool write_rpath(const char *file, const struct stat *st, const struct elf *e,
+			uint64_t rpath_off, size_t old_len, const char *rpath,
+			uint64_t rpath_tag_off)
+{
+	size_t dsize = e->is64 ? 8 : 4;
+	unsigned char tag[8];
+	char *buf;
+	bool ok;
+	int fd;
+
+	/* Make the file writable if necessary, like the script did */
+	if (!(st->st_mode & S_IWUSR) && chmod(file, (st->st_mode & 07777) | S_IWUSR))
+		return false;
+	fd = open(file, O_WRONLY | O_CLOEXEC);
+	buf = malloc(old_len + 1);
+	ok = fd >= 0 && buf;
+	if (ok) {
+		memset(buf, 'X', old_len);
+		memcpy(buf, rpath, strlen(rpath) + 1);
+		buf[old_len] = '\0';
+		ok = pwrite(fd, buf, old_len + 1, rpath_off) == (ssize_t)(old_len + 1);
+	}
+	if (ok && rpath_tag_off) {
+		wr(e, tag, DT_RUNPATH, dsize);
+		ok = pwrite(fd, tag, dsize, rpath_tag_off) == (ssize_t)dsize;
+	}
+	if (fd >= 0 && close(fd))
+		ok = false;
+	free(buf);
+	if (!(st->st_mode & S_IWUSR))
+		chmod(file, st->st_mode & 07777);
+	return ok;
+}
+
+static int process(const char *file, int out)
+{
+	unsigned char ident[EI_NIDENT];
+	struct section dynamic = { 0 }, dynstr = { 0 };
+	uint64_t rpath_off = 0, rpath_tag_off = 0, i;
+	const char *rpath = NULL;
+	bool has_rpath = false, has_runpath = false;
+	size_t dsize, old_len;
+	struct elf e;
+	struct stat st;
+	char *new_rpath;
+	int fd, ret = STAT_SCANNED;
+
+	fd = open(file, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+	if (fd < 0)
+		return STAT_SKIPPED;
+	if (fstat(fd, &st) || pread(fd, ident, sizeof(ident), 0) != sizeof(ident) ||
+	    memcmp(ident, ELFMAG, SELFMAG) ||
+	    (ident[EI_CLASS] != ELFCLASS32 && ident[EI_CLASS] != ELFCLASS64) ||
+	    (ident[EI_DATA] != ELFDATA2LSB && ident[EI_DATA] != ELFDATA2MSB)) {
+		close(fd);
+		return STAT_SCANNED;
+	}
+	e.size = st.st_size;
+	e.is64 = ident[EI_CLASS] == ELFCLASS64;
+	e.msb = ident[EI_DATA] == ELFDATA2MSB;
+	e.map = mmap(NULL, e.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (e.map == MAP_FAILED)
+		return STAT_SKIPPED;
+	if (!find_sections(&e, &dynamic, &dynstr))
+		goto out;
+
+	/* Like patchelf: the DT_RUNPATH if there is one, else DT_RPATH */
+	dsize = e.is64 ? 8 : 4;
+	for (i = 0; i + 2 * dsize <= dynamic.size; i += 2 * dsize) {
+		uint64_t off = dynamic.offset + i;
+		uint64_t tag = rd(&e, off, dsize), val = rd(&e, off + dsize, dsize);
+
+		if (tag == DT_NULL)
+			break;
+		if (tag != DT_RPATH && tag != DT_RUNPATH)
+			continue;
+		if (tag == DT_RPATH) {
+			has_rpath = true;
+			rpath_tag_off = off;
+			if (has_runpath)
+				continue;
+		} else {
+			has_runpath = true;
+		}
+		if (val >= dynstr.size ||
+		    !memchr(e.map + dynstr.offset + val, '\0', dynstr.size - val))
+			goto out;
+		rpath = (const char *)e.map + dynstr.offset + val;
+		rpath_off = dynstr.offset + val;
+	}
+	if (!rpath)
+		goto out;
+
+	ret = STAT_ELF;
+	new_rpath = sanitize_rpath(rpath, file);
+	if (!new_rpath) {
+		ret = STAT_SKIPPED;
+		goto out;
+	}
+	old_len = strlen(rpath);
+	if (strcmp(new_rpath, rpath)) {
+		if (strlen(new_rpath) > old_len) {
+			/* Needs a bigger .dynstr: patchelf rewrites the file */
+			dprintf(out, "F %s\n", file);
+			ret = STAT_FALLBACK;
+		} else if (write_rpath(file, &st, &e, rpath_off, old_len, new_rpath,
+				       has_rpath && !has_runpath ? rpath_tag_off : 0)) {
+			ret = STAT_REWRITTEN;
+		} else {
+			fprintf(stderr, "%s: %s: %s\n", progname, file, strerror(errno));
+			ret = STAT_SKIPPED;
+		}
+	}
+	free(new_rpath);
+out:
+	munmap((void *)e.map, e.size);
+	return ret;
+}
+
+static char **files;
+static size_t nfiles, afiles;
+
+static void add_file(const char *path)
+{
+	if (nfiles == afiles) {
+		afiles = afiles ? 2 * afiles : 1024;
+		files = realloc(files, afiles * sizeof(*files));
+		if (!files) {
+			perror(progname);
+			exit(1);
+		}
+	}
+	files[nfiles++] = strdup(path);
+}
+
+static int collect(const char *path, const struct stat *st, int type,
+		   struct FTW *ftw)
+{
+	size_t i;
+
+	(void)ftw;
+	for (i = 0; i < nexcludes; i++)
+		if (!strcmp(path, excludes[i]))
+			return type == FTW_D ? FTW_SKIP_SUBTREE : FTW_CONTINUE;
+	if (type == FTW_F && S_ISREG(st->st_mode))
+		add_file(path);
+	return FTW_CONTINUE;
+}
+
+/* The files listed in list, separated by NUL characters, rather than
+ * all the files of ROOTDIR */
+static int read_list(const char *list)
+{
+	char *path = NULL;
+	size_t len = 0, i, n;
+	struct stat st;
+	FILE *f;
+
+	f = fopen(list, "r");
+	if (!f)
+		return -1;
+	while (getdelim(&path, &len, '\0', f) > 0) {
+		for (i = 0; i < nexcludes; i++) {
+			n = strlen(excludes[i]);
+			if (!strncmp(path, excludes[i], n) &&
+			    (path[n] == '\0' || path[n] == '/'))
+				break;
+		}
+		if (i == nexcludes && !lstat(path, &st) && S_ISREG(st.st_mode))
+			add_file(path);
+	}
+	free(path);
+	fclose(f);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-j JOBS] [-r] [-s] [-P PER_PACKAGE_DIR -H HOST_DIR] [-x PATH]...\n"
+		"       [-L LIST] ROOTDIR\n",
+		progname);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long stats[NSTATS] = { 0 };
+	const char *list = NULL;
+	char *line = NULL;
+	size_t len = 0, i;
+	int pipefd[2], opt, j;
+	long jobs = 0;
+	FILE *f;
+
+	progname = argv[0];
+	while ((opt = getopt(argc, argv, "j:rsP:H:x:L:")) != -1) {
+		switch (opt) {
+		case 'j':
+			jobs = strtol(optarg, NULL, 10);
+			break;
+		case 'r':
+			relative_to_file = true;
+			break;
+		case 's':
+			no_standard_lib_dirs = true;
+			break;
+		case 'P':
+			ppd_dir = optarg;
+			break;
+		case 'H':
+			host_dir = optarg;
+			break;
+		case 'x':
+			excludes = realloc(excludes, (nexcludes + 1) * sizeof(*excludes));
+			if (!excludes) {
+				perror(progname);
+				return 1;
+			}
+			excludes[nexcludes++] = optarg;
+			break;
+		case 'L':
+			list = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1 || !ppd_dir != !host_dir)
+		usage();
+	root_dir = argv[optind];
+	if (jobs <= 0)
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (jobs <= 0)
+		jobs = 1;
+
+	if (list ? read_list(list) :
+	    nftw(root_dir, collect, 64, FTW_PHYS | FTW_ACTIONRETVAL)) {
+		fprintf(stderr, "%s: %s: %s\n", progname, list ? list : root_dir,
+			strerror(errno));
+		return 1;
+	}
+
+	/* Each worker handles every JOBS-th file, and reports the result
+	 * of each file, and the files left to patchelf, on a pipe */
+	if (pipe(pipefd)) {
+		perror(progname);
+		return 1;
+	}
+	fflush(NULL);
+	for (j = 0; j < jobs; j++) {
+		pid_t pid = fork();
+
+		if (pid < 0) {
+			perror(progname);
+			return 1;
+		}
+		if (pid)
+			continue;
+		close(pipefd[0]);
+		for (i = j; i < nfiles; i += jobs)
+			dprintf(pipefd[1], "S %d\n", process(files[i], pipefd[1]));
+		_exit(0);
+	}
+	close(pipefd[1]);
+	f = fdopen(pipefd[0], "r");
+	while (getline(&line, &len, f) > 0) {
+		if (line[0] == 'F') {
+			fputs(line + 2, stdout);
+		} else if (line[0] == 'S') {
+			int s = atoi(line + 2);
+
+			stats[STAT_SCANNED]++;
+			if (s > STAT_SCANNED && s < NSTATS) {
+				stats[s]++;
+				if (s != STAT_ELF)
+					stats[STAT_ELF]++;
+			}
+		}
+	}
+	free(line);
+	fclose(f);
+	while (wait(NULL) > 0)
+		;
+
+	fprintf(stderr, "%s: %s:", progname, root_dir);
+	for (i = 0; i < NSTATS; i++)
+		fprintf(stderr, "%s %lu %s", i ? "," : "", stats[i], stat_names[i]);
+	fputc('\n', stderr);
+	return fflush(stdout) ? 1 : 0;
+}
@@ -0,0 +1,928 @@
+/**
+ * Buildroot build step log. Records the start and end of each step of
+ * each package (see step_time in package/pkg-generic.mk) as fixed-size
+ * binary records appended to a log file, and converts such a log to
+ * the text format of the former build-time.log, to JSON, or to the
+ * Chrome trace-event format (for chrome://tracing or Perfetto).
+ *
+ *   step-log record LOG start|end STEP PACKAGE [PID]
+ *   step-log run LOG STEP PACKAGE SHELL ARGS...
+ *   step-log dump [-f text|json|chrome] LOG
+ *   step-log priorities LOG GRAPH
+ *
+ * Besides the time, each record holds the CPU time and the storage I/O
+ * of the children of the make process running the step (PID), as
+ * accounted by the kernel when they exit. The usage of a step is the
+ * difference between its end and start records; it is only accurate
+ * when packages are built one at a time, as the steps of other packages
+ * built at the same time by the same make are accounted too.
+ *
+ * For an accurate usage, 'run' is used as the shell of the steps
+ * (BR2_RECORD_RESOURCE_USAGE). It runs each command of the step, and
+ * appends a usage record with the resources used by the command and
+ * its children, as returned by wait4(): CPU time, peak RSS of the
+ * biggest process, block I/O and context switches. When it can, it
+ * also runs the command in its own cgroup v2, to record the peak
+ * memory of the whole command (including the page cache) and the
+ * bytes it read and wrote, from the memory and io controllers. The
+ * usage of a step is then the sum of its usage records.
+ *
+ * 'priorities' prints the packages of GRAPH (one line per package: its
+ * name, then the names of its dependencies) as a make variable, from
+ * the longest to the shortest path to the end of the build, from the
+ * durations of the last build of their steps in the log. Building the
+ * packages in this order first builds the ones on the critical path
+ * (BR2_PER_PACKAGE_SCHEDULER).
+ *
+ * Records are appended with a single write() on a file opened with
+ * O_APPEND, so that concurrent steps never interleave.
+ *
+ * This file is licensed under the terms of the GNU General Public License
+ * version 2.  This program is licensed "as is" without any warranty of any
+ * kind, whether express or implied.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mntent.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RECORD_MAGIC	"BRSL"
+#define RECORD_VERSION	2
+
+/* Set by 'run' for the commands of a step, so that nested shells are
+ * not recorded twice, and so that 'record' finds the make process. */
+#define PID_ENV		"STEP_LOG_PID"
+
+enum {
+	STATE_START,
+	STATE_END,
+	STATE_USAGE,
+};
+
+#define FLAG_CGROUP_MEMORY	(1 << 0)
+#define FLAG_CGROUP_IO		(1 << 1)
+
+/* All the fields are in the byte order of the host */
+struct record {
+	char magic[4];
+	uint16_t version;
+	uint16_t size;
+	uint32_t pid;		/* make process running the step */
+	uint32_t state;
+	uint64_t time_ns;	/* since the Epoch */
+	uint64_t utime_us;	/* cumulative, of the children of pid */
+	uint64_t stime_us;
+	uint64_t read_bytes;
+	uint64_t write_bytes;
+	uint64_t max_rss_kb;	/* usage records only */
+	uint64_t cgroup_peak_kb;
+	uint64_t voluntary_switches;
+	uint64_t involuntary_switches;
+	uint32_t flags;
+	uint32_t reserved;
+	char step[32];
+	char package[128];
+};
+
+static const char *progname;
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s record LOG start|end STEP PACKAGE [PID]\n"
+		"       %s run LOG STEP PACKAGE SHELL ARGS...\n"
+		"       %s dump [-f text|json|chrome] LOG\n"
+		"       %s priorities LOG GRAPH\n",
+		progname, progname, progname, progname);
+	exit(2);
+}
+
+static void copy_name(char *dst, size_t size, const char *src)
+{
+	/* Always NUL-terminated, the rest of the field is zeroed */
+	memset(dst, 0, size);
+	strncpy(dst, src, size - 1);
+}
+
+/* Children CPU times, from fields 16 and 17 of /proc/<pid>/stat */
+static void read_cpu_times(pid_t pid, struct record *r)
+{
+	char path[64], buf[1024], *p;
+	unsigned long long cutime, cstime;
+	long ticks = sysconf(_SC_CLK_TCK);
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0 || ticks <= 0)
+		return;
+	buf[len] = '\0';
+
+	/* The command name may contain spaces, skip past it */
+	p = strrchr(buf, ')');
+	if (!p || sscanf(p + 1,
+			 " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u"
+			 " %llu %llu", &cutime, &cstime) != 2)
+		return;
+	r->utime_us = cutime * 1000000 / ticks;
+	r->stime_us = cstime * 1000000 / ticks;
+}
+
+/* Storage I/O, including the one of the exited children */
+static void read_io(pid_t pid, struct record *r)
+{
+	char path[64], line[128];
+	unsigned long long val;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+	f = fopen(path, "r");
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "read_bytes: %llu", &val) == 1)
+			r->read_bytes = val;
+		else if (sscanf(line, "write_bytes: %llu", &val) == 1)
+			r->write_bytes = val;
+	}
+	fclose(f);
+}
+
+static void init_record(struct record *r, uint32_t state, const char *step,
+			const char *package, pid_t pid)
+{
+	struct timespec ts;
+
+	memset(r, 0, sizeof(*r));
+	memcpy(r->magic, RECORD_MAGIC, sizeof(r->magic));
+	r->version = RECORD_VERSION;
+	r->size = sizeof(*r);
+	r->state = state;
+	r->pid = pid;
+	copy_name(r->step, sizeof(r->step), step);
+	copy_name(r->package, sizeof(r->package), package);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	r->time_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int write_record(const char *log, const struct record *r)
+{
+	ssize_t ret;
+	int fd;
+
+	fd = open(log, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s: %s\n", progname, log, strerror(errno));
+		return 1;
+	}
+	ret = write(fd, r, sizeof(*r));
+	if (ret != sizeof(*r)) {
+		fprintf(stderr, "%s: %s: %s\n", progname, log,
+			ret < 0 ? strerror(errno) : "short write");
+		close(fd);
+		return 1;
+	}
+	return close(fd) ? 1 : 0;
+}
+
+static int do_record(int argc, char **argv)
+{
+	struct record r;
+	uint32_t state;
+	pid_t pid;
+
+	if (argc < 5 || argc > 6)
+		usage();
+
+	if (!strcmp(argv[2], "start"))
+		state = STATE_START;
+	else if (!strcmp(argv[2], "end"))
+		state = STATE_END;
+	else
+		usage();
+
+	pid = argc == 6 ? (pid_t)strtol(argv[5], NULL, 10) : getppid();
+	init_record(&r, state, argv[3], argv[4], pid);
+	read_cpu_times(pid, &r);
+	read_io(pid, &r);
+
+	return write_record(argv[1], &r);
+}
+
+/* Mount point of the cgroup v2 hierarchy, either the only one or the
+ * unified one of a hybrid setup */
+static char *cgroup_root(void)
+{
+	struct mntent *m;
+	char *root = NULL;
+	FILE *f;
+
+	f = setmntent("/proc/self/mounts", "r");
+	if (!f)
+		return NULL;
+	while ((m = getmntent(f))) {
+		if (!strcmp(m->mnt_type, "cgroup2")) {
+			root = strdup(m->mnt_dir);
+			break;
+		}
+	}
+	endmntent(f);
+	return root;
+}
+
+/* Leaf cgroup for a command, next to the cgroup we are in, or NULL if
+ * cgroup v2 is not available or not writable. */
+static char *cgroup_create(void)
+{
+	char line[4096], *root, *path = NULL;
+	FILE *f;
+
+	root = cgroup_root();
+	if (!root)
+		return NULL;
+	f = fopen("/proc/self/cgroup", "r");
+	if (!f) {
+		free(root);
+		return NULL;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, "0::", 3))
+			continue;
+		line[strcspn(line, "\n")] = '\0';
+		if (asprintf(&path, "%s%s/step-log.%d", root,
+			     strcmp(line + 3, "/") ? line + 3 : "", (int)getpid()) < 0)
+			path = NULL;
+		break;
+	}
+	fclose(f);
+	free(root);
+
+	if (path && mkdir(path, 0755)) {
+		free(path);
+		path = NULL;
+	}
+	return path;
+}
+
+/* Move the calling process to a cgroup */
+static bool cgroup_enter(const char *cgroup)
+{
+	char *procs;
+	bool ok;
+	int fd;
+
+	if (asprintf(&procs, "%s/cgroup.procs", cgroup) < 0)
+		return false;
+	fd = open(procs, O_WRONLY | O_CLOEXEC);
+	free(procs);
+	if (fd < 0)
+		return false;
+	ok = write(fd, "0", 1) == 1;
+	close(fd);
+	return ok;
+}
+
+static FILE *cgroup_open(const char *cgroup, const char *file)
+{
+	char *path;
+	FILE *f;
+
+	if (asprintf(&path, "%s/%s", cgroup, file) < 0)
+		return NULL;
+	f = fopen(path, "r");
+	free(path);
+	return f;
+}
+
+/* The memory and io files only exist if those controllers are enabled
+ * for the cgroup we are in. */
+static void cgroup_read(const char *cgroup, struct record *r)
+{
+	unsigned long long val;
+	char line[1024], *p;
+	FILE *f;
+
+	f = cgroup_open(cgroup, "memory.peak");
+	if (f) {
+		if (fscanf(f, "%llu", &val) == 1) {
+			r->cgroup_peak_kb = val / 1024;
+			r->flags |= FLAG_CGROUP_MEMORY;
+		}
+		fclose(f);
+	}
+
+	f = cgroup_open(cgroup, "io.stat");
+	if (f) {
+		r->read_bytes = r->write_bytes = 0;
+		r->flags |= FLAG_CGROUP_IO;
+		/* One line per device: MAJ:MIN rbytes=N wbytes=N ... */
+		while (fgets(line, sizeof(line), f)) {
+			if ((p = strstr(line, " rbytes=")) && sscanf(p, " rbytes=%llu", &val) == 1)
+				r->read_bytes += val;
+			if ((p = strstr(line, " wbytes=")) && sscanf(p, " wbytes=%llu", &val) == 1)
+				r->write_bytes += val;
+		}
+		fclose(f);
+	}
+}
+
+/* make exports SHELL, i.e. this wrapper command line: give the
+ * command the actual shell instead */
+static void exec_shell(char **argv)
+{
+	setenv("SHELL", argv[0], 1);
+	execvp(argv[0], argv);
+	fprintf(stderr, "%s: %s: %s\n", progname, argv[0], strerror(errno));
+}
+
+static int do_run(int argc, char **argv)
+{
+	struct record r;
+	struct rusage ru;
+	struct sigaction ign, oldint, oldquit;
+	char *cgroup = NULL, pid_env[16], entered = 0;
+	pid_t child, make_pid;
+	int status, sync[2];
+
+	if (argc < 5)
+		usage();
+
+	/* Nested shell of a step already being recorded */
+	if (getenv(PID_ENV)) {
+		exec_shell(argv + 4);
+		return 127;
+	}
+
+	make_pid = getppid();
+	snprintf(pid_env, sizeof(pid_env), "%d", (int)make_pid);
+	cgroup = cgroup_create();
+
+	/* Like system(), leave interrupting the command to the command */
+	memset(&ign, 0, sizeof(ign));
+	ign.sa_handler = SIG_IGN;
+	sigaction(SIGINT, &ign, &oldint);
+	sigaction(SIGQUIT, &ign, &oldquit);
+
+	/* The child tells whether it could enter the cgroup, before
+	 * running the command */
+	if (pipe2(sync, O_CLOEXEC) < 0 || (child = fork()) < 0) {
+		perror(progname);
+		return 1;
+	}
+	if (child == 0) {
+		close(sync[0]);
+		sigaction(SIGINT, &oldint, NULL);
+		sigaction(SIGQUIT, &oldquit, NULL);
+		if (cgroup && cgroup_enter(cgroup) && write(sync[1], "y", 1) < 0)
+			_exit(127);
+		setenv(PID_ENV, pid_env, 1);
+		exec_shell(argv + 4);
+		_exit(127);
+	}
+	close(sync[1]);
+	while (read(sync[0], &entered, 1) < 0 && errno == EINTR)
+		;
+	close(sync[0]);
+
+	while (wait4(child, &status, 0, &ru) < 0) {
+		if (errno != EINTR) {
+			perror(progname);
+			return 1;
+		}
+	}
+
+	init_record(&r, STATE_USAGE, argv[2], argv[3], make_pid);
+	r.utime_us = (uint64_t)ru.ru_utime.tv_sec * 1000000 + ru.ru_utime.tv_usec;
+	r.stime_us = (uint64_t)ru.ru_stime.tv_sec * 1000000 + ru.ru_stime.tv_usec;
+	r.max_rss_kb = ru.ru_maxrss;
+	r.read_bytes = (uint64_t)ru.ru_inblock * 512;
+	r.write_bytes = (uint64_t)ru.ru_oublock * 512;
+	r.voluntary_switches = ru.ru_nvcsw;
+	r.involuntary_switches = ru.ru_nivcsw;
+	if (cgroup) {
+		if (entered)
+			cgroup_read(cgroup, &r);
+		/* Fails if the command left processes behind; keep it then */
+		rmdir(cgroup);
+		free(cgroup);
+	}
+	if (write_record(argv[1], &r))
+		return 1;
+
+	if (WIFSIGNALED(status)) {
+		signal(WTERMSIG(status), SIG_DFL);
+		raise(WTERMSIG(status));
+		return 128 + WTERMSIG(status);
+	}
+	return WEXITSTATUS(status);
+}
+
+static struct record *read_log(const char *path, size_t *count)
+{
+	struct record *records;
+	struct stat st;
+	size_t i, done = 0;
+	ssize_t ret;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st)) {
+		fprintf(stderr, "%s: %s: %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	if (st.st_size % sizeof(struct record)) {
+		fprintf(stderr, "%s: %s: truncated log\n", progname, path);
+		exit(1);
+	}
+	records = malloc(st.st_size ? st.st_size : 1);
+	if (!records) {
+		perror(progname);
+		exit(1);
+	}
+	while (done < (size_t)st.st_size) {
+		ret = read(fd, (char *)records + done, st.st_size - done);
+		if (ret <= 0) {
+			fprintf(stderr, "%s: %s: %s\n", progname, path,
+				ret < 0 ? strerror(errno) : "unexpected end of file");
+			exit(1);
+		}
+		done += ret;
+	}
+	close(fd);
+
+	*count = st.st_size / sizeof(struct record);
+	for (i = 0; i < *count; i++) {
+		if (memcmp(records[i].magic, RECORD_MAGIC, sizeof(records[i].magic)) ||
+		    records[i].version != RECORD_VERSION ||
+		    records[i].size != sizeof(struct record)) {
+			fprintf(stderr, "%s: %s: invalid record %zu\n", progname, path, i);
+			exit(1);
+		}
+	}
+	return records;
+}
+
+/* Index of the start record matching an end record, or -1 */
+static ssize_t find_start(const struct record *records, bool *matched, size_t end)
+{
+	const struct record *e = &records[end];
+	size_t i;
+
+	for (i = end; i-- > 0; ) {
+		const struct record *s = &records[i];
+
+		if (matched[i] || s->state != STATE_START || s->pid != e->pid ||
+		    strcmp(s->step, e->step) || strcmp(s->package, e->package))
+			continue;
+		matched[i] = true;
+		return i;
+	}
+	return -1;
+}
+
+static void print_json_string(const char *s)
+{
+	putchar('"');
+	for (; *s; s++) {
+		unsigned char c = *s;
+
+		if (c == '"' || c == '\\')
+			printf("\\%c", c);
+		else if (c < 0x20)
+			printf("\\u%04x", c);
+		else
+			putchar(c);
+	}
+	putchar('"');
+}
+
+/* Usage of the step between a start and an end record: the sum of its
+ * usage records if there are, else the difference between the
+ * cumulative usage of the make children at the start and at the end. */
+static void step_usage(const struct record *records, size_t start, size_t end,
+		       struct record *u)
+{
+	const struct record *b = &records[start], *e = &records[end];
+	bool found = false;
+	size_t i;
+
+	memset(u, 0, sizeof(*u));
+	for (i = start + 1; i < end; i++) {
+		const struct record *r = &records[i];
+
+		if (r->state != STATE_USAGE || r->pid != e->pid ||
+		    strcmp(r->step, e->step) || strcmp(r->package, e->package))
+			continue;
+		found = true;
+		u->utime_us += r->utime_us;
+		u->stime_us += r->stime_us;
+		u->read_bytes += r->read_bytes;
+		u->write_bytes += r->write_bytes;
+		u->voluntary_switches += r->voluntary_switches;
+		u->involuntary_switches += r->involuntary_switches;
+		if (r->max_rss_kb > u->max_rss_kb)
+			u->max_rss_kb = r->max_rss_kb;
+		if (r->cgroup_peak_kb > u->cgroup_peak_kb)
+			u->cgroup_peak_kb = r->cgroup_peak_kb;
+		u->flags |= r->flags;
+		u->state = STATE_USAGE;
+	}
+	if (found)
+		return;
+
+	u->state = STATE_END;
+	u->utime_us = e->utime_us - b->utime_us;
+	u->stime_us = e->stime_us - b->stime_us;
+	u->read_bytes = e->read_bytes - b->read_bytes;
+	u->write_bytes = e->write_bytes - b->write_bytes;
+}
+
+static void dump_text(const struct record *records, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		const struct record *r = &records[i];
+
+		if (r->state == STATE_USAGE)
+			continue;
+		printf("%" PRIu64 ".%09" PRIu64 ":%-5.5s:%-20.20s: %s\n",
+		       r->time_ns / 1000000000, r->time_ns % 1000000000,
+		       r->state == STATE_START ? "start" : "end",
+		       r->step, r->package);
+	}
+}
+
+static void dump_events(const struct record *records, size_t count, bool chrome)
+{
+	bool *matched = calloc(count ? count : 1, sizeof(bool));
+	const char **packages = calloc(count ? count : 1, sizeof(char *));
+	size_t i, npackages = 0, tid;
+	const char *sep = "";
+	ssize_t s;
+
+	if (!matched || !packages) {
+		perror(progname);
+		exit(1);
+	}
+
+	printf(chrome ? "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [" : "[");
+	for (i = 0; i < count; i++) {
+		const struct record *e = &records[i], *b;
+		struct record u;
+
+		if (e->state != STATE_END || (s = find_start(records, matched, i)) < 0)
+			continue;
+		b = &records[s];
+		step_usage(records, s, i, &u);
+
+		printf("%s\n  {", sep);
+		sep = ",";
+		if (chrome) {
+			/* One thread per package, so each gets its own row */
+			for (tid = 0; tid < npackages; tid++)
+				if (!strcmp(packages[tid], e->package))
+					break;
+			if (tid == npackages) {
+				packages[npackages++] = e->package;
+				printf("\"name\": \"thread_name\", \"ph\": \"M\", "
+				       "\"pid\": %" PRIu32 ", \"tid\": %zu, \"args\": {\"name\": ",
+				       e->pid, tid);
+				print_json_string(e->package);
+				printf("}},\n  {");
+			}
+			printf("\"name\": ");
+			print_json_string(e->step);
+			printf(", \"cat\": ");
+			print_json_string(e->package);
+			printf(", \"ph\": \"X\", \"ts\": %" PRIu64 ", \"dur\": %" PRIu64
+			       ", \"pid\": %" PRIu32 ", \"tid\": %zu, \"args\": {",
+			       b->time_ns / 1000, (e->time_ns - b->time_ns) / 1000,
+			       e->pid, tid);
+		} else {
+			printf("\"package\": ");
+			print_json_string(e->package);
+			printf(", \"step\": ");
+			print_json_string(e->step);
+			printf(", \"start\": %" PRIu64 ".%09" PRIu64
+			       ", \"end\": %" PRIu64 ".%09" PRIu64
+			       ", \"duration\": %" PRIu64 ".%09" PRIu64 ", \"pid\": %" PRIu32 ", ",
+			       b->time_ns / 1000000000, b->time_ns % 1000000000,
+			       e->time_ns / 1000000000, e->time_ns % 1000000000,
+			       (e->time_ns - b->time_ns) / 1000000000,
+			       (e->time_ns - b->time_ns) % 1000000000, e->pid);
+		}
+		printf("\"utime\": %" PRIu64 ".%06" PRIu64 ", \"stime\": %" PRIu64 ".%06" PRIu64
+		       ", \"read_bytes\": %" PRIu64 ", \"write_bytes\": %" PRIu64,
+		       u.utime_us / 1000000, u.utime_us % 1000000,
+		       u.stime_us / 1000000, u.stime_us % 1000000,
+		       u.read_bytes, u.write_bytes);
+		/* Only known from usage records */
+		if (u.state == STATE_USAGE)
+			printf(", \"max_rss_kb\": %" PRIu64
+			       ", \"voluntary_switches\": %" PRIu64
+			       ", \"involuntary_switches\": %" PRIu64,
+			       u.max_rss_kb, u.voluntary_switches, u.involuntary_switches);
+		if (u.flags & FLAG_CGROUP_MEMORY)
+			printf(", \"cgroup_peak_kb\": %" PRIu64, u.cgroup_peak_kb);
+		printf(", \"source\": \"%s\"}",
+		       u.state != STATE_USAGE ? "make" :
+		       u.flags & FLAG_CGROUP_IO ? "cgroup" : "rusage");
+		if (chrome)
+			putchar('}');
+	}
+	printf(chrome ? "\n]}\n" : "\n]\n");
+
+	free(packages);
+	free(matched);
+}
+
+static int do_dump(int argc, char **argv)
+{
+	const char *format = "text";
+	struct record *records;
+	size_t count;
+	int opt;
+
+	optind = 2;
+	while ((opt = getopt(argc, argv, "f:")) != -1) {
+		if (opt != 'f')
+			usage();
+		format = optarg;
+	}
+	if (optind != argc - 1)
+		usage();
+
+	records = read_log(argv[optind], &count);
+	if (!strcmp(format, "text"))
+		dump_text(records, count);
+	else if (!strcmp(format, "json"))
+		dump_events(records, count, false);
+	else if (!strcmp(format, "chrome"))
+		dump_events(records, count, true);
+	else
+		usage();
+	free(records);
+
+	if (fflush(stdout) || ferror(stdout)) {
+		perror(progname);
+		return 1;
+	}
+	return 0;
+}
+
+/* Steps of a package, only the last build of each one is counted */
+static const char *const steps[] = {
+	"download", "actual-download", "extract", "rsync", "patch",
+	"configure", "build", "install-host", "install-staging",
+	"install-image", "install-target",
+};
+#define NSTEPS (sizeof(steps) / sizeof(steps[0]))
+
+struct node {
+	char *name;
+	char **dep_names;
+	size_t *deps;
+	size_t ndeps;
+	uint64_t step_ns[NSTEPS];
+	uint64_t duration_ns;
+	uint64_t tail_ns;	/* longest path to the end of the build */
+	bool known;
+	int visit;
+};
+
+static int node_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct node *)a)->name, ((const struct node *)b)->name);
+}
+
+static struct node *find_node(struct node *nodes, size_t count, const char *name)
+{
+	struct node key = { .name = (char *)name };
+
+	return bsearch(&key, nodes, count, sizeof(*nodes), node_cmp);
+}
+
+static struct node *read_graph(const char *path, size_t *count)
+{
+	struct node *nodes = NULL;
+	size_t alloc = 0, n = 0, len = 0;
+	char *line = NULL, *word, *save;
+	FILE *f;
+
+	f = fopen(path, "re");
+	if (!f) {
+		fprintf(stderr, "%s: %s: %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	while (getline(&line, &len, f) > 0) {
+		struct node *nd;
+
+		word = strtok_r(line, " \t\n", &save);
+		if (!word)
+			continue;
+		if (n == alloc) {
+			alloc = alloc ? 2 * alloc : 256;
+			nodes = realloc(nodes, alloc * sizeof(*nodes));
+			if (!nodes) {
+				perror(progname);
+				exit(1);
+			}
+		}
+		nd = &nodes[n++];
+		memset(nd, 0, sizeof(*nd));
+		nd->name = strdup(word);
+		while ((word = strtok_r(NULL, " \t\n", &save))) {
+			nd->dep_names = realloc(nd->dep_names,
+						(nd->ndeps + 1) * sizeof(char *));
+			if (!nd->dep_names) {
+				perror(progname);
+				exit(1);
+			}
+			nd->dep_names[nd->ndeps++] = strdup(word);
+		}
+	}
+	free(line);
+	fclose(f);
+
+	*count = n;
+	return nodes;
+}
+
+/* Depth-first, so that the dependencies of a node come before it */
+static void topo_sort(struct node *nodes, size_t i, size_t *order, size_t *norder)
+{
+	size_t d;
+
+	if (nodes[i].visit)
+		return;
+	nodes[i].visit = 1;
+	for (d = 0; d < nodes[i].ndeps; d++)
+		topo_sort(nodes, nodes[i].deps[d], order, norder);
+	order[(*norder)++] = i;
+}
+
+static int tail_cmp(const void *a, const void *b)
+{
+	const struct node *na = *(const struct node *const *)a;
+	const struct node *nb = *(const struct node *const *)b;
+
+	if (na->tail_ns != nb->tail_ns)
+		return na->tail_ns < nb->tail_ns ? 1 : -1;
+	return strcmp(na->name, nb->name);
+}
+
+static int do_priorities(int argc, char **argv)
+{
+	struct record *records;
+	struct node *nodes, *nd, **sorted;
+	size_t count, nnodes, i, j, d, norder = 0, nknown = 0, *order;
+	uint64_t known_ns = 0, default_ns;
+	bool *matched;
+	ssize_t s;
+
+	if (argc != 4)
+		usage();
+
+	/* Without a log, only the dependencies are taken into account */
+	if (access(argv[2], F_OK) && errno == ENOENT) {
+		records = NULL;
+		count = 0;
+	} else {
+		records = read_log(argv[2], &count);
+	}
+	nodes = read_graph(argv[3], &nnodes);
+	qsort(nodes, nnodes, sizeof(*nodes), node_cmp);
+	for (i = j = 0; i < nnodes; i++)
+		if (!j || strcmp(nodes[i].name, nodes[j - 1].name))
+			nodes[j++] = nodes[i];
+	nnodes = j;
+
+	/* Dependencies that are not in the graph are ignored */
+	for (i = 0; i < nnodes; i++) {
+		nd = &nodes[i];
+		nd->deps = calloc(nd->ndeps ? nd->ndeps : 1, sizeof(size_t));
+		if (!nd->deps) {
+			perror(progname);
+			exit(1);
+		}
+		for (j = d = 0; j < nd->ndeps; j++) {
+			struct node *dep = find_node(nodes, nnodes, nd->dep_names[j]);
+
+			if (dep && dep != nd)
+				nd->deps[d++] = dep - nodes;
+		}
+		nd->ndeps = d;
+	}
+
+	matched = calloc(count ? count : 1, sizeof(bool));
+	if (!matched) {
+		perror(progname);
+		exit(1);
+	}
+	for (i = 0; i < count; i++) {
+		const struct record *e = &records[i];
+
+		if (e->state != STATE_END || (s = find_start(records, matched, i)) < 0 ||
+		    !(nd = find_node(nodes, nnodes, e->package)))
+			continue;
+		for (j = 0; j < NSTEPS; j++)
+			if (!strcmp(e->step, steps[j]))
+				break;
+		if (j == NSTEPS)
+			continue;
+		nd->step_ns[j] = e->time_ns - records[s].time_ns;
+		nd->known = true;
+	}
+	for (i = 0; i < nnodes; i++) {
+		nd = &nodes[i];
+		for (j = 0; j < NSTEPS; j++)
+			nd->duration_ns += nd->step_ns[j];
+		if (nd->known) {
+			known_ns += nd->duration_ns;
+			nknown++;
+		}
+	}
+
+	/* Packages never built yet take the mean duration of the others,
+	 * and without any duration, the longest chain of dependencies
+	 * comes first */
+	default_ns = nknown ? known_ns / nknown : 1;
+	for (i = 0; i < nnodes; i++)
+		if (!nodes[i].known)
+			nodes[i].duration_ns = default_ns;
+
+	/* In reverse topological order, the tail of a package is final
+	 * when it is reached, as all the packages depending on it have
+	 * been handled */
+	order = calloc(nnodes ? nnodes : 1, sizeof(size_t));
+	sorted = calloc(nnodes ? nnodes : 1, sizeof(struct node *));
+	if (!order || !sorted) {
+		perror(progname);
+		exit(1);
+	}
+	for (i = 0; i < nnodes; i++)
+		topo_sort(nodes, i, order, &norder);
+	for (i = 0; i < nnodes; i++)
+		nodes[i].tail_ns = nodes[i].duration_ns;
+	for (i = norder; i-- > 0; ) {
+		nd = &nodes[order[i]];
+		for (d = 0; d < nd->ndeps; d++) {
+			struct node *dep = &nodes[nd->deps[d]];
+
+			if (dep->duration_ns + nd->tail_ns > dep->tail_ns)
+				dep->tail_ns = dep->duration_ns + nd->tail_ns;
+		}
+	}
+
+	for (i = 0; i < nnodes; i++)
+		sorted[i] = &nodes[i];
+	qsort(sorted, nnodes, sizeof(*sorted), tail_cmp);
+	printf("# Generated by step-log priorities, do not edit\n"
+	       "BUILD_PRIORITIES =");
+	for (i = 0; i < nnodes; i++)
+		printf(" \\\n\t%s", sorted[i]->name);
+	putchar('\n');
+
+	if (fflush(stdout) || ferror(stdout)) {
+		perror(progname);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	progname = argv[0];
+
+	if (argc < 2)
+		usage();
+	if (!strcmp(argv[1], "record"))
+		return do_record(argc - 1, argv + 1);
+	if (!strcmp(argv[1], "run"))
+		return do_run(argc - 1, argv + 1);
+	if (!strcmp(argv[1], "dump"))
+		return do_dump(argc, argv);
+	if (!strcmp(argv[1], "priorities"))
+		return do_priorities(argc, argv);
+	usage();
+	return 2;
+}
@@ -0,0 +1,705 @@
+/**
+ * Strip the ELF files of the target directory.
+ *
+ *   strip-tree [-j JOBS] [-x DIR]... [-n NAME]... [-d OPTION]
+ *              [-g DEBUG_DIR -c OBJCOPY] [-l PKG-FILE-LIST]... [-o STATS]
+ *              [-L LIST] ROOTDIR STRIP [ARGS...]
+ *
+ * The files stripped are the regular files that are executable or named
+ * *.so*, except the kernel modules (*.ko), and libpthread*.so* and
+ * ld-*.so* which are only stripped with OPTION (--strip-debug by
+ * default): a non-stripped libpthread is needed to debug threaded
+ * programs with gdb, and a non-stripped dynamic linker for valgrind.
+ * The files named NAME (BR2_STRIP_EXCLUDE_FILES) are skipped, and so is
+ * what is under the directories DIR, relative to ROOTDIR
+ * (BR2_STRIP_EXCLUDE_DIRS). Both are shell patterns, like for find's
+ * -name and -path. With -L, only the files listed in LIST, separated by
+ * NUL characters (e.g. the ELF files found by finalize-target), are
+ * considered rather than all the files of ROOTDIR.
+ *
+ * Only the ELF files that still have something to strip (symbols, debug
+ * info, or the .comment and .note sections for a full strip) are passed
+ * to STRIP ARGS, by JOBS processes (by default, one per CPU). With -g,
+ * the debug info of each file is first extracted with OBJCOPY into the
+ * same path under DEBUG_DIR, with a .debug suffix, and referenced from
+ * the stripped file with a debug link.
+ *
+ * The bytes saved are written to STATS, as CSV, for each package, the
+ * files of the packages being the ones listed in their PKG-FILE-LIST
+ * (.files-list.txt). A summary is printed on the standard error.
+ *
+ * This file is licensed under the terms of the GNU General Public License
+ * version 2.  This program is licensed "as is" without any warranty of any
+ * kind, whether express or implied.
+ */
+
+#define _GNU_SOURCE
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <ftw.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Files passed to one strip command */
+#define BATCH_SIZE	64
+
+static const char *progname, *root_dir, *debug_dir, *objcopy;
+static const char *debug_option = "--strip-debug";
+static char **strip_argv;
+static int strip_argc;
+
+static void *xrealloc(void *p, size_t size)
+{
+	p = realloc(p, size);
+	if (!p) {
+		perror(progname);
+		exit(1);
+	}
+	return p;
+}
+
+static char *xstrdup(const char *s)
+{
+	char *p = strdup(s);
+
+	if (!p) {
+		perror(progname);
+		exit(1);
+	}
+	return p;
+}
+
+/*
+ * Shell patterns, the ones without any special character being looked
+ * up in a sorted array rather than with fnmatch(), as most are plain
+ * names.
+ */
+struct matcher {
+	const char **literals, **globs;
+	size_t nliterals, nglobs;
+};
+
+static int cmp_str(const void *a, const void *b)
+{
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static void matcher_add(struct matcher *m, const char *pattern)
+{
+	if (strpbrk(pattern, "*?[\\")) {
+		m->globs = xrealloc(m->globs, (m->nglobs + 1) * sizeof(*m->globs));
+		m->globs[m->nglobs++] = pattern;
+	} else {
+		m->literals = xrealloc(m->literals,
+				       (m->nliterals + 1) * sizeof(*m->literals));
+		m->literals[m->nliterals++] = pattern;
+	}
+}
+
+static void matcher_compile(struct matcher *m)
+{
+	if (m->nliterals)
+		qsort(m->literals, m->nliterals, sizeof(*m->literals), cmp_str);
+}
+
+static bool matcher_match(const struct matcher *m, const char *s)
+{
+	size_t i;
+
+	if (m->nliterals &&
+	    bsearch(&s, m->literals, m->nliterals, sizeof(*m->literals), cmp_str))
+		return true;
+	for (i = 0; i < m->nglobs; i++)
+		if (!fnmatch(m->globs[i], s, 0))
+			return true;
+	return false;
+}
+
+static struct matcher exclude_dirs, exclude_files;
+
+static const char *const debug_only_names[] = { "libpthread*.so*", "ld-*.so*" };
+
+enum strip_mode {
+	STRIP_NONE,
+	STRIP_ALL,
+	STRIP_DEBUG,
+};
+
+struct file {
+	char *path;
+	off_t size_before, size_after;
+	enum strip_mode mode;
+};
+
+static struct file *files;
+static size_t nfiles, afiles;
+
+static enum strip_mode strip_mode(const char *name, const struct stat *st)
+{
+	size_t i;
+
+	if (matcher_match(&exclude_files, name))
+		return STRIP_NONE;
+	for (i = 0; i < sizeof(debug_only_names) / sizeof(debug_only_names[0]); i++)
+		if (!fnmatch(debug_only_names[i], name, 0))
+			return STRIP_DEBUG;
+	if (!fnmatch("*.ko", name, 0))
+		return STRIP_NONE;
+	if ((st->st_mode & 0111) || !fnmatch("*.so*", name, 0))
+		return STRIP_ALL;
+	return STRIP_NONE;
+}
+
+static void add_file(const char *path, const char *name, const struct stat *st)
+{
+	enum strip_mode mode = strip_mode(name, st);
+
+	if (mode == STRIP_NONE)
+		return;
+	if (nfiles == afiles) {
+		afiles = afiles ? 2 * afiles : 1024;
+		files = xrealloc(files, afiles * sizeof(*files));
+	}
+	files[nfiles].path = xstrdup(path);
+	files[nfiles].size_before = files[nfiles].size_after = st->st_size;
+	files[nfiles].mode = mode;
+	nfiles++;
+}
+
+static int collect(const char *path, const struct stat *st, int type,
+		   struct FTW *ftw)
+{
+	if (ftw->level > 0 && type == FTW_D &&
+	    matcher_match(&exclude_dirs, path + strlen(root_dir) + 1))
+		return FTW_SKIP_SUBTREE;
+	if (type == FTW_F && S_ISREG(st->st_mode))
+		add_file(path, path + ftw->base, st);
+	return FTW_CONTINUE;
+}
+
+/* The files listed in list, separated by NUL characters, rather than
+ * all the files of ROOTDIR */
+static int read_list(const char *list)
+{
+	size_t len = 0, root_len = strlen(root_dir);
+	char *path = NULL, *p;
+	struct stat st;
+	bool excluded;
+	FILE *f;
+
+	f = fopen(list, "r");
+	if (!f)
+		return -1;
+	while (getdelim(&path, &len, '\0', f) > 0) {
+		if (strncmp(path, root_dir, root_len) || path[root_len] != '/' ||
+		    lstat(path, &st) || !S_ISREG(st.st_mode))
+			continue;
+		/* Like the pruning of the walk: any parent directory */
+		excluded = false;
+		for (p = path + root_len + 1; !excluded && (p = strchr(p, '/')); p++) {
+			*p = '\0';
+			excluded = matcher_match(&exclude_dirs, path + root_len + 1);
+			*p = '/';
+		}
+		if (!excluded)
+			add_file(path, strrchr(path, '/') + 1, &st);
+	}
+	free(path);
+	fclose(f);
+	return 0;
+}
+
+struct elf {
+	const unsigned char *map;
+	size_t size;
+	bool is64, msb;
+};
+
+static uint64_t rd(const struct elf *e, size_t off, int bytes)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < bytes; i++)
+		v |= (uint64_t)e->map[off + (e->msb ? bytes - 1 - i : i)] << (8 * i);
+	return v;
+}
+
+/* Whether STRIP would remove something from the file, from the names
+ * of its sections. Not an ELF file, or not one we can parse: false. */
+static bool needs_strip(const char *path, enum strip_mode mode)
+{
+	unsigned char ident[EI_NIDENT];
+	uint64_t shoff, shnum, shstrndx, stroff, strsize, i;
+	size_t shentsize;
+	bool ret = false;
+	struct stat st;
+	struct elf e;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &st) || pread(fd, ident, sizeof(ident), 0) != sizeof(ident) ||
+	    memcmp(ident, ELFMAG, SELFMAG) ||
+	    (ident[EI_CLASS] != ELFCLASS32 && ident[EI_CLASS] != ELFCLASS64) ||
+	    (ident[EI_DATA] != ELFDATA2LSB && ident[EI_DATA] != ELFDATA2MSB)) {
+		close(fd);
+		return false;
+	}
+	e.size = st.st_size;
+	e.is64 = ident[EI_CLASS] == ELFCLASS64;
+	e.msb = ident[EI_DATA] == ELFDATA2MSB;
+	e.map = mmap(NULL, e.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (e.map == MAP_FAILED)
+		return false;
+	if (e.size < (e.is64 ? 64u : 52u))
+		goto out;
+
+	shoff = rd(&e, e.is64 ? 40 : 32, e.is64 ? 8 : 4);
+	shentsize = rd(&e, e.is64 ? 58 : 46, 2);
+	shnum = rd(&e, e.is64 ? 60 : 48, 2);
+	shstrndx = rd(&e, e.is64 ? 62 : 50, 2);
+	if (shentsize < (e.is64 ? 64u : 40u) || shoff > e.size ||
+	    shnum * shentsize > e.size - shoff || shstrndx >= shnum)
+		goto out;
+#define SH(i, off32, off64) \
+	rd(&e, shoff + (i) * shentsize + (e.is64 ? (off64) : (off32)), e.is64 ? 8 : 4)
+	stroff = SH(shstrndx, 16, 24);
+	strsize = SH(shstrndx, 20, 32);
+	if (stroff > e.size || strsize > e.size - stroff)
+		goto out;
+	for (i = 0; i < shnum && !ret; i++) {
+		uint64_t name = rd(&e, shoff + i * shentsize, 4);
+		const char *s = (const char *)e.map + stroff + name;
+
+		if (name >= strsize || !memchr(s, '\0', strsize - name))
+			continue;
+		if (!strncmp(s, ".debug", 6) || !strncmp(s, ".zdebug", 7) ||
+		    !strncmp(s, ".stab", 5))
+			ret = true;
+		else if (mode == STRIP_ALL &&
+			 (!strcmp(s, ".symtab") || !strcmp(s, ".comment") ||
+			  !strcmp(s, ".note")))
+			ret = true;
+	}
+#undef SH
+out:
+	munmap((void *)e.map, e.size);
+	return ret;
+}
+
+/* Run a command, and return whether it succeeded */
+static bool run(char **argv)
+{
+	pid_t pid;
+	int status;
+
+	fflush(NULL);
+	pid = fork();
+	if (pid < 0) {
+		perror(progname);
+		return false;
+	}
+	if (pid == 0) {
+		execvp(argv[0], argv);
+		fprintf(stderr, "%s: %s: %s\n", progname, argv[0], strerror(errno));
+		_exit(127);
+	}
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR)
+			return false;
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static bool run_strip(enum strip_mode mode, struct file **batch, size_t n)
+{
+	char **argv = xrealloc(NULL, (strip_argc + n + 2) * sizeof(*argv));
+	size_t i, argc = 0;
+	bool ok;
+
+	for (i = 0; i < (size_t)strip_argc; i++)
+		argv[argc++] = strip_argv[i];
+	if (mode == STRIP_DEBUG)
+		argv[argc++] = (char *)debug_option;
+	for (i = 0; i < n; i++)
+		argv[argc++] = batch[i]->path;
+	argv[argc] = NULL;
+	ok = run(argv);
+	free(argv);
+	return ok;
+}
+
+static int mkdir_parents(char *path)
+{
+	char *p;
+
+	for (p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		if (mkdir(path, 0755) && errno != EEXIST) {
+			*p = '/';
+			return -1;
+		}
+		*p = '/';
+	}
+	return 0;
+}
+
+/* Extract the debug info of a file before it is stripped, and return
+ * the path of the debug file */
+static char *extract_debug(const struct file *f)
+{
+	char *argv[] = { (char *)objcopy, "--only-keep-debug", f->path, NULL, NULL };
+	char *debug;
+
+	if (asprintf(&debug, "%s%s.debug", debug_dir, f->path + strlen(root_dir)) < 0) {
+		perror(progname);
+		exit(1);
+	}
+	if (mkdir_parents(debug)) {
+		fprintf(stderr, "%s: %s: %s\n", progname, debug, strerror(errno));
+		free(debug);
+		return NULL;
+	}
+	argv[3] = debug;
+	if (!run(argv)) {
+		free(debug);
+		return NULL;
+	}
+	return debug;
+}
+
+static void add_debuglink(const struct file *f, const char *debug)
+{
+	char *argv[] = { (char *)objcopy, NULL, f->path, NULL };
+	char *opt;
+
+	if (asprintf(&opt, "--add-gnu-debuglink=%s", debug) < 0) {
+		perror(progname);
+		exit(1);
+	}
+	argv[1] = opt;
+	run(argv);
+	free(opt);
+}
+
+static void report(int out, const struct file *f)
+{
+	struct stat st;
+
+	if (stat(f->path, &st))
+		st.st_size = f->size_before;
+	dprintf(out, "%zu %lld\n", (size_t)(f - files), (long long)st.st_size);
+}
+
+static void flush(int out, enum strip_mode mode, struct file **batch, size_t *n)
+{
+	size_t i;
+
+	if (!*n)
+		return;
+	run_strip(mode, batch, *n);
+	for (i = 0; i < *n; i++)
+		report(out, batch[i]);
+	*n = 0;
+}
+
+/* Strip the files of one worker, in batches, and report their new size
+ * on out, or -1 for the ones that had nothing to strip */
+static void worker(int id, int jobs, int out)
+{
+	struct file *all[BATCH_SIZE], *debug[BATCH_SIZE];
+	size_t nall = 0, ndebug = 0, i;
+
+	for (i = id; i < nfiles; i += jobs) {
+		struct file *f = &files[i];
+
+		if (!needs_strip(f->path, f->mode)) {
+			dprintf(out, "%zu -1\n", i);
+		} else if (debug_dir) {
+			char *path = extract_debug(f);
+
+			run_strip(f->mode, &f, 1);
+			if (path)
+				add_debuglink(f, path);
+			free(path);
+			report(out, f);
+		} else if (f->mode == STRIP_DEBUG) {
+			debug[ndebug++] = f;
+			if (ndebug == BATCH_SIZE)
+				flush(out, STRIP_DEBUG, debug, &ndebug);
+		} else {
+			all[nall++] = f;
+			if (nall == BATCH_SIZE)
+				flush(out, STRIP_ALL, all, &nall);
+		}
+	}
+	flush(out, STRIP_ALL, all, &nall);
+	flush(out, STRIP_DEBUG, debug, &ndebug);
+}
+
+/* Package of each file, from the PKG-FILE-LISTs */
+struct owner {
+	char *path;
+	const char *pkg;
+	size_t order;
+};
+
+static struct owner *owners;
+static size_t nowners;
+
+static int cmp_owner(const void *a, const void *b)
+{
+	const struct owner *oa = a, *ob = b;
+	int ret = strcmp(oa->path, ob->path);
+
+	if (ret)
+		return ret;
+	return oa->order < ob->order ? -1 : oa->order > ob->order;
+}
+
+static void read_file_list(const char *list)
+{
+	char *line = NULL, *path;
+	size_t len = 0, aowners = nowners;
+	ssize_t n;
+	FILE *f;
+
+	f = fopen(list, "r");
+	if (!f) {
+		fprintf(stderr, "%s: %s: %s\n", progname, list, strerror(errno));
+		exit(1);
+	}
+	while ((n = getline(&line, &len, f)) > 0) {
+		if (line[n - 1] == '\n')
+			line[n - 1] = '\0';
+		path = strchr(line, ',');
+		if (!path)
+			continue;
+		*path++ = '\0';
+		if (!strncmp(path, "./", 2))
+			path++;
+		if (nowners == aowners) {
+			aowners = aowners ? 2 * aowners : 1024;
+			owners = xrealloc(owners, aowners * sizeof(*owners));
+		}
+		owners[nowners].path = xstrdup(path);
+		owners[nowners].pkg = xstrdup(line);
+		owners[nowners].order = nowners;
+		nowners++;
+	}
+	free(line);
+	fclose(f);
+}
+
+/* The last package installing a file owns it */
+static const char *owner(const char *path)
+{
+	struct owner key = { (char *)path, NULL, SIZE_MAX }, *o;
+	size_t lo = 0, hi = nowners;
+
+	/* First entry greater than the last one for this path */
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if (cmp_owner(&owners[mid], &key) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!lo)
+		return NULL;
+	o = &owners[lo - 1];
+	return strcmp(o->path, path) ? NULL : o->pkg;
+}
+
+struct pkg_stats {
+	const char *pkg;
+	unsigned long files;
+	long long before, after;
+};
+
+static int cmp_stats(const void *a, const void *b)
+{
+	const struct pkg_stats *sa = a, *sb = b;
+	long long da = sa->before - sa->after, db = sb->before - sb->after;
+
+	if (da != db)
+		return da < db ? 1 : -1;
+	return strcmp(sa->pkg, sb->pkg);
+}
+
+static int write_stats(const char *path)
+{
+	struct pkg_stats *stats = NULL;
+	size_t nstats = 0, i, j;
+	FILE *f;
+
+	for (i = 0; i < nfiles; i++) {
+		const char *pkg;
+
+		if (files[i].mode == STRIP_NONE)
+			continue;
+		pkg = owner(files[i].path + strlen(root_dir));
+		if (!pkg)
+			pkg = "Unknown";
+		for (j = 0; j < nstats; j++)
+			if (!strcmp(stats[j].pkg, pkg))
+				break;
+		if (j == nstats) {
+			stats = xrealloc(stats, (nstats + 1) * sizeof(*stats));
+			stats[nstats].pkg = pkg;
+			stats[nstats].files = 0;
+			stats[nstats].before = stats[nstats].after = 0;
+			nstats++;
+		}
+		stats[j].files++;
+		stats[j].before += files[i].size_before;
+		stats[j].after += files[i].size_after;
+	}
+	qsort(stats, nstats, sizeof(*stats), cmp_stats);
+
+	f = fopen(path, "w");
+	if (!f) {
+		fprintf(stderr, "%s: %s: %s\n", progname, path, strerror(errno));
+		return -1;
+	}
+	fprintf(f, "Package name,Stripped files,Size before,Size after,Bytes saved\n");
+	for (i = 0; i < nstats; i++)
+		fprintf(f, "%s,%lu,%lld,%lld,%lld\n", stats[i].pkg, stats[i].files,
+			stats[i].before, stats[i].after, stats[i].before - stats[i].after);
+	free(stats);
+	return fclose(f) ? -1 : 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-j JOBS] [-x DIR]... [-n NAME]... [-d OPTION]\n"
+		"       [-g DEBUG_DIR -c OBJCOPY] [-l PKG-FILE-LIST]... [-o STATS]\n"
+		"       [-L LIST] ROOTDIR STRIP [ARGS...]\n", progname);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long stripped = 0, skipped = 0;
+	long long saved = 0;
+	const char *stats = NULL, *list = NULL;
+	char *line = NULL;
+	size_t len = 0, i;
+	int pipefd[2], opt, j;
+	long jobs = 0;
+	FILE *f;
+
+	progname = argv[0];
+	/* '+': the options of STRIP are not ours */
+	while ((opt = getopt(argc, argv, "+j:x:n:d:g:c:l:o:L:")) != -1) {
+		switch (opt) {
+		case 'j':
+			jobs = strtol(optarg, NULL, 10);
+			break;
+		case 'x':
+			matcher_add(&exclude_dirs, optarg);
+			break;
+		case 'n':
+			matcher_add(&exclude_files, optarg);
+			break;
+		case 'd':
+			debug_option = optarg;
+			break;
+		case 'g':
+			debug_dir = optarg;
+			break;
+		case 'c':
+			objcopy = optarg;
+			break;
+		case 'l':
+			read_file_list(optarg);
+			break;
+		case 'o':
+			stats = optarg;
+			break;
+		case 'L':
+			list = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind < 2 || !debug_dir != !objcopy)
+		usage();
+	root_dir = argv[optind];
+	strip_argv = argv + optind + 1;
+	strip_argc = argc - optind - 1;
+	if (jobs <= 0)
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (jobs <= 0)
+		jobs = 1;
+	matcher_compile(&exclude_dirs);
+	matcher_compile(&exclude_files);
+	qsort(owners, nowners, sizeof(*owners), cmp_owner);
+
+	if (list ? read_list(list) :
+	    nftw(root_dir, collect, 64, FTW_PHYS | FTW_ACTIONRETVAL)) {
+		fprintf(stderr, "%s: %s: %s\n", progname, list ? list : root_dir,
+			strerror(errno));
+		return 1;
+	}
+
+	if (pipe(pipefd)) {
+		perror(progname);
+		return 1;
+	}
+	fflush(NULL);
+	for (j = 0; j < jobs; j++) {
+		pid_t pid = fork();
+
+		if (pid < 0) {
+			perror(progname);
+			return 1;
+		}
+		if (pid)
+			continue;
+		close(pipefd[0]);
+		worker(j, jobs, pipefd[1]);
+		_exit(0);
+	}
+	close(pipefd[1]);
+	f = fdopen(pipefd[0], "r");
+	while (getline(&line, &len, f) > 0) {
+		long long size;
+
+		if (sscanf(line, "%zu %lld", &i, &size) != 2 || i >= nfiles)
+			continue;
+		if (size < 0) {
+			/* Not counted in the stats */
+			files[i].mode = STRIP_NONE;
+			skipped++;
+			continue;
+		}
+		files[i].size_after = size;
+		saved += files[i].size_before - size;
+		stripped++;
+	}
+	free(line);
+	fclose(f);
+	while (wait(NULL) > 0)
+		;
+
+	fprintf(stderr, "%s: %s: %lu files stripped, %lu already stripped or not ELF, "
+		"%lld bytes saved\n", progname, root_dir, stripped, skipped, saved);
+	if (stats && write_stats(stats))
+		return 1;
+	return 0;
+}
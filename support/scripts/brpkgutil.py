@@ -1,12 +1,140 @@
 # Copyright (C) 2010-2013 Thomas Petazzoni <thomas.petazzoni@free-electrons.com>
 # Copyright (C) 2019 Yann E. MORIN <yann.morin.1998@free.fr>
 
+import hashlib
 import json
 import logging
 import os
 import subprocess
 from collections import defaultdict
 
+# The output of 'make show-info' is cached next to the .config, along
+# with the makefiles it was generated from, as listed by make itself in
+# MAKEFILE_LIST. It is valid as long as none of them changed, and the
+# host tools are the same: support/dependencies/ adds the host packages
+# of the missing or unsuitable ones to the dependencies. Rather than
+# running make to check them, which costs as much as show-info, any
+# change to the directories of the PATH invalidates the cache, as
+# installing, removing or upgrading a tool does.
+SHOW_INFO_CACHE = ".show-info.cache"
+SHOW_INFO_CACHE_VERSION = 2
+
+# The output of 'make show-info', once loaded
+_show_info = None
+
+
+def _run_show_info(targets):
+    cmd = ["make", "-s", "--no-print-directory"] + targets
+    with open(os.devnull, 'wb') as devnull:
+        p = subprocess.Popen(cmd, stdout=subprocess.PIPE, stderr=devnull,
+                             universal_newlines=True)
+        out = p.communicate()[0]
+    if p.returncode != 0:
+        raise RuntimeError("'{}' failed".format(" ".join(cmd)))
+
+    # Each <pkg>-show-info outputs its own JSON object, then printvars
+    # outputs one VAR=value line per variable
+    info = {}
+    variables = {}
+    decoder = json.JSONDecoder()
+    out = out.strip()
+    while out.startswith("{"):
+        obj, end = decoder.raw_decode(out)
+        info.update(obj)
+        out = out[end:].strip()
+    for line in out.splitlines():
+        var, _, value = line.partition("=")
+        variables[var] = value
+    return info, variables
+
+
+# A makefile is unchanged when it has the same size and modification
+# time, or else the same content
+def _file_hash(path):
+    with open(path, "rb") as f:
+        return hashlib.sha1(f.read()).hexdigest()
+
+
+def _file_unchanged(entry):
+    path, size, mtime, digest = entry
+    try:
+        st = os.stat(path)
+        if st.st_size != size:
+            return False
+        return st.st_mtime_ns == mtime or _file_hash(path) == digest
+    except OSError:
+        return False
+
+
+def _host_tools():
+    dirs = []
+    for d in os.environ.get("PATH", "").split(os.pathsep):
+        try:
+            dirs.append([d, os.stat(d or ".").st_mtime_ns])
+        except OSError:
+            dirs.append([d, None])
+    return dirs
+
+
+def _load_show_info_cache():
+    try:
+        with open(SHOW_INFO_CACHE) as f:
+            cache = json.load(f)
+    except (OSError, ValueError):
+        return None
+    if cache.get("version") != SHOW_INFO_CACHE_VERSION or \
+       not all(_file_unchanged(e) for e in cache["makefiles"]) or \
+       cache["host_tools"] != _host_tools():
+        return None
+    return cache["info"]
+
+
+def _save_show_info_cache(info, variables):
+    topdir = variables["TOPDIR"]
+    makefiles = []
+    for path in set(variables["MAKEFILE_LIST"].split() + [variables["BR2_CONFIG"]]):
+        path = os.path.join(topdir, path)
+        st = os.stat(path)
+        makefiles.append([path, st.st_size, st.st_mtime_ns, _file_hash(path)])
+    tmp = "{}.{}".format(SHOW_INFO_CACHE, os.getpid())
+    with open(tmp, "w") as f:
+        json.dump({"version": SHOW_INFO_CACHE_VERSION,
+                   "makefiles": sorted(makefiles),
+                   "host_tools": _host_tools(),
+                   "info": info}, f)
+    os.replace(tmp, SHOW_INFO_CACHE)
+
+
+# This function returns the information about the packages, as output
+# by 'make show-info', or by 'make <pkg>-show-info' for each of the
+# packages given in the pkgs list.
+#
+# When run from the directory of the .config, the output of 'make
+# show-info' is cached, and only generated again when the .config, one
+# of the makefiles or the host tools changed. It is also only loaded
+# once.
+def get_show_info(pkgs=None):
+    global _show_info
+
+    cached = os.path.exists(".config")
+    if cached and _show_info is None:
+        _show_info = _load_show_info_cache()
+    if cached and _show_info is None:
+        info, variables = _run_show_info(["show-info", "printvars",
+                                          "VARS=MAKEFILE_LIST TOPDIR BR2_CONFIG"])
+        try:
+            _save_show_info_cache(info, variables)
+        except (OSError, KeyError) as e:
+            logging.warning("Not caching show-info: {}".format(e))
+        _show_info = info
+
+    if not pkgs:
+        return _show_info if cached else _run_show_info(["show-info"])[0]
+    # Packages which are not enabled are not part of 'make show-info'
+    if cached and all(p in _show_info for p in pkgs):
+        return {p: _show_info[p] for p in pkgs}
+    return _run_show_info(["{}-show-info".format(p) for p in pkgs])[0]
+
 
 # This function returns a tuple of four dictionaries, all using package
 # names as keys:
@@ -30,11 +158,7 @@ def get_dependency_tree():
     types['all'] = 'target'
     versions['all'] = ''
 
-    cmd = ["make", "-s", "--no-print-directory", "show-info"]
-    with open(os.devnull, 'wb') as devnull:
-        p = subprocess.Popen(cmd, stdout=subprocess.PIPE, stderr=devnull,
-                             universal_newlines=True)
-        pkg_list = json.loads(p.communicate()[0])
+    pkg_list = get_show_info()
 
     for pkg in pkg_list:
         deps['all'].append(pkg)
@@ -0,0 +1,95 @@
+"""Test cases for support/helpers/sanitize-rpath.
+
+It does not inherit from infra.basetest.BRTest and therefore does not generate
+a logfile. Only when the tests fail there will be output to the console.
+
+The expected RPATHs are the ones "patchelf --make-rpath-relative" gives with
+the Buildroot patch, as used by support/scripts/fix-rpath.
+"""
+import os
+import shutil
+import subprocess
+import tempfile
+import unittest
+
+import infra
+
+
+class TestSanitizeRpath(unittest.TestCase):
+    def setUp(self):
+        self.tmpdir = tempfile.mkdtemp()
+        self.helper = os.path.join(self.tmpdir, "sanitize-rpath")
+        subprocess.check_call(["cc", "-o", self.helper,
+                               infra.filepath("../helpers/sanitize-rpath.c")])
+        self.main = os.path.join(self.tmpdir, "main.c")
+        with open(self.main, "w") as f:
+            f.write("int main(void) { return 0; }\n")
+
+    def tearDown(self):
+        shutil.rmtree(self.tmpdir)
+
+    def mkdirs(self, root, dirs):
+        for d in dirs:
+            os.makedirs(os.path.join(root, d), exist_ok=True)
+
+    def build(self, path, rpath, new_dtags=True):
+        os.makedirs(os.path.dirname(path), exist_ok=True)
+        ldflags = ["-Wl,-rpath," + rpath]
+        if not new_dtags:
+            ldflags.append("-Wl,--disable-new-dtags")
+        subprocess.check_call(["cc", "-o", path, self.main] + ldflags)
+
+    def rpath(self, path):
+        out = subprocess.check_output(["readelf", "-d", path],
+                                      universal_newlines=True)
+        for line in out.splitlines():
+            if "(RPATH)" in line or "(RUNPATH)" in line:
+                return line.split()[1], line.split("[")[1].rstrip("]")
+        return None
+
+    def run_helper(self, args):
+        return subprocess.check_output([self.helper] + args,
+                                       universal_newlines=True).splitlines()
+
+    def test_target(self):
+        root = os.path.join(self.tmpdir, "target")
+        self.mkdirs(root, ["usr/lib/x", "opt/lib", "opt/lib2", "lib"])
+        foo = os.path.join(root, "usr/bin/foo")
+        old = os.path.join(root, "usr/bin/old")
+        fw = os.path.join(root, "lib/firmware/fw")
+        self.build(foo, "/usr/lib:/opt/lib:/nonexistent:$ORIGIN/../lib/x:" +
+                   root + "/opt/lib2")
+        self.build(old, "/lib:/opt/lib", new_dtags=False)
+        os.chmod(old, 0o555)
+        self.build(fw, "/lib", new_dtags=False)
+
+        out = self.run_helper(["-s", "-x", os.path.dirname(fw), root])
+        self.assertEqual(out, [])
+        self.assertEqual(self.rpath(foo),
+                         ("(RUNPATH)", "/opt/lib:/usr/lib/x:/opt/lib2"))
+        self.assertEqual(self.rpath(old), ("(RUNPATH)", "/opt/lib"))
+        self.assertEqual(os.stat(old).st_mode & 0o777, 0o555)
+        self.assertEqual(self.rpath(fw), ("(RPATH)", "/lib"))
+
+    def test_host(self):
+        root = os.path.join(self.tmpdir, "host")
+        ppd = os.path.join(self.tmpdir, "per-package")
+        self.mkdirs(root, ["lib", "usr/lib"])
+        self.mkdirs(ppd, ["foo/host/lib"])
+        tool = os.path.join(root, "bin/tool")
+        deep = os.path.join(root, "a/b/c/d/e/f/g/h/i/j/deep")
+        self.build(tool, ppd + "/foo/host/lib:" + root + "/usr/lib")
+        self.build(deep, root + "/lib")
+
+        # The new RPATH of deep is longer, it is left to patchelf
+        out = self.run_helper(["-r", "-P", ppd, "-H", root, root])
+        self.assertEqual(out, [deep])
+        self.assertEqual(self.rpath(tool),
+                         ("(RUNPATH)", "$ORIGIN/../lib:$ORIGIN/../usr/lib"))
+        self.assertEqual(self.rpath(deep), ("(RUNPATH)", root + "/lib"))
+
+        # Already sanitized, only deep is left to patchelf again
+        out = self.run_helper(["-r", "-P", ppd, "-H", root, root])
+        self.assertEqual(out, [deep])
+        self.assertEqual(self.rpath(tool),
+                         ("(RUNPATH)", "$ORIGIN/../lib:$ORIGIN/../usr/lib"))
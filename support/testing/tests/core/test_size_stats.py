@@ -0,0 +1,109 @@
+"""Test cases for support/scripts/size-stats and utils/size-stats-compare.
+
+It does not inherit from infra.basetest.BRTest and therefore does not generate
+a logfile. Only when the tests fail there will be output to the console.
+"""
+import csv
+import os
+import shutil
+import subprocess
+import tempfile
+import unittest
+
+import infra
+
+
+class TestSizeStats(unittest.TestCase):
+    def setUp(self):
+        self.tmpdir = tempfile.mkdtemp()
+        self.script = infra.filepath("../scripts/size-stats")
+        self.compare = infra.filepath("../../utils/size-stats-compare")
+
+    def tearDown(self):
+        shutil.rmtree(self.tmpdir)
+
+    def builddir(self, name, files, links=()):
+        """Fake output directory, files maps paths to (package, size)"""
+        builddir = os.path.join(self.tmpdir, name)
+        os.makedirs(os.path.join(builddir, "build"))
+        with open(os.path.join(builddir, "build",
+                               "packages-file-list.txt"), "w") as f:
+            for path, (pkg, size) in files.items():
+                full = os.path.join(builddir, "target", path)
+                os.makedirs(os.path.dirname(full), exist_ok=True)
+                with open(full, "wb") as fp:
+                    fp.write(b"x" * size)
+                if pkg:
+                    f.write("%s,./%s\n" % (pkg, path))
+            for src, dst in links:
+                full = os.path.join(builddir, "target", dst)
+                os.makedirs(os.path.dirname(full), exist_ok=True)
+                os.link(os.path.join(builddir, "target", src), full)
+                f.write("%s,./%s\n" % (files[src][0], dst))
+        return builddir
+
+    def run_script(self, builddir, args):
+        return subprocess.check_output([self.script, "--builddir", builddir] +
+                                       args, universal_newlines=True)
+
+    def read_csv(self, path):
+        with open(path) as f:
+            return list(csv.reader(f))[1:]
+
+    def test_hardlinks(self):
+        builddir = self.builddir("out", {
+            "bin/busybox": ("busybox", 1000),
+            "lib/libc.so": ("glibc", 300),
+            "usr/lib/foo.py": ("foo", 10),
+            "usr/lib/foo.pyc": (None, 20),
+            "etc/stray": (None, 5),
+        }, links=[("bin/busybox", "bin/sh"), ("bin/busybox", "sbin/init")])
+        pkgcsv = os.path.join(self.tmpdir, "pkg.csv")
+        filecsv = os.path.join(self.tmpdir, "file.csv")
+        manifest = os.path.join(self.tmpdir, "manifest.csv")
+        out = self.run_script(builddir, ["-p", pkgcsv, "-f", filecsv,
+                                         "-m", manifest])
+        self.assertIn("WARNING: etc/stray is not part of any package", out)
+        sizes = {r[0]: int(r[1]) for r in self.read_csv(pkgcsv)}
+        self.assertEqual(sizes, {"busybox": 1000, "glibc": 300, "foo": 30,
+                                 "unknown": 5})
+        files = {r[0]: (r[1], int(r[2])) for r in self.read_csv(filecsv)}
+        self.assertEqual(files["bin/busybox"], ("busybox", 1000))
+        self.assertEqual(files["bin/sh"], ("busybox", 0))
+        self.assertEqual(files["sbin/init"], ("busybox", 0))
+        self.assertEqual(files["usr/lib/foo.pyc"], ("foo", 20))
+        self.assertEqual(len(self.read_csv(manifest)), 7)
+
+    def test_compare(self):
+        old = self.builddir("old", {
+            "bin/busybox": ("busybox", 1000),
+            "lib/libc.so": ("glibc", 300),
+            "lib/libold.so": ("foo", 50),
+            "usr/bin/tool": ("foo", 40),
+        })
+        new = self.builddir("new", {
+            "bin/busybox": ("busybox", 1100),
+            "lib/libc.so": ("glibc", 300),
+            "lib/libnew.so": ("foo", 200),
+            "usr/bin/tool": ("bar", 40),
+        })
+        manifest = os.path.join(self.tmpdir, "old.csv")
+        self.run_script(old, ["-m", manifest])
+        out = self.run_script(new, ["-c", manifest]).splitlines()
+        self.assertEqual([line.split() for line in out[2:-2]], [
+            ["110", "foo"],
+            ["200", "added", "lib/libnew.so"],
+            ["-40", "moved", "usr/bin/tool"],
+            ["-50", "removed", "lib/libold.so"],
+            ["100", "busybox"],
+            ["100", "bin/busybox"],
+            ["40", "bar"],
+            ["40", "moved", "usr/bin/tool"],
+        ])
+        self.assertEqual(out[-1].split(), ["250", "TOTAL"])
+
+        newmanifest = os.path.join(self.tmpdir, "new.csv")
+        self.run_script(new, ["-m", newmanifest])
+        out = subprocess.check_output([self.compare, manifest, newmanifest],
+                                      universal_newlines=True).splitlines()
+        self.assertEqual(out[-1].split(), ["250", "TOTAL"])
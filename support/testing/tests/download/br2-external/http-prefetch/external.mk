@@ -0,0 +1,4 @@
+include $(sort $(wildcard $(BR2_EXTERNAL_HTTP_PREFETCH_PATH)/package/*/*.mk))
+
+# Get the http server port number from the test infra
+HTTPREMOTE_PORT_NUMBER ?= 8000
@@ -0,0 +1,11 @@
+################################################################################
+#
+# prefetch-big
+#
+################################################################################
+
+PREFETCH_BIG_VERSION = 1.0
+PREFETCH_BIG_SOURCE = prefetch-big-$(PREFETCH_BIG_VERSION).txt
+PREFETCH_BIG_SITE = http://localhost:$(HTTPREMOTE_PORT_NUMBER)
+
+$(eval $(generic-package))
@@ -0,0 +1,11 @@
+################################################################################
+#
+# prefetch-small
+#
+################################################################################
+
+PREFETCH_SMALL_VERSION = 1.0
+PREFETCH_SMALL_SOURCE = prefetch-small-$(PREFETCH_SMALL_VERSION).txt
+PREFETCH_SMALL_SITE = http://localhost:$(HTTPREMOTE_PORT_NUMBER)
+
+$(eval $(generic-package))
@@ -0,0 +1,77 @@
+import functools
+import http.server
+import os
+import subprocess
+import threading
+
+import infra
+
+
+class HttpPrefetchTestBase(infra.basetest.BRConfigTest):
+    config = \
+        """
+        BR2_BACKUP_SITE=""
+        """
+    br2_external = [infra.filepath("tests/download/br2-external/http-prefetch")]
+    httpremotedir = infra.filepath("tests/download/http-remote")
+    packages = ["prefetch-small", "prefetch-big"]
+
+    def setUp(self):
+        super(HttpPrefetchTestBase, self).setUp()
+        handler = functools.partial(http.server.SimpleHTTPRequestHandler,
+                                    directory=self.httpremotedir)
+        self.server = http.server.ThreadingHTTPServer(("localhost", 0), handler)
+        self.server_thread = threading.Thread(target=self.server.serve_forever)
+        self.server_thread.start()
+
+    def tearDown(self):
+        self.show_msg("Cleaning up")
+        self.server.shutdown()
+        self.server.server_close()
+        self.server_thread.join()
+        if self.b and not self.keepbuilds:
+            self.b.delete()
+
+    def prefetch(self, *args):
+        # store downloaded files inside the output dir so the test infra
+        # cleans them up at the end
+        dl_dir = os.path.join(self.builddir, "dl")
+        env = {"PATH": os.environ["PATH"],
+               "BR2_DL_DIR": dl_dir,
+               "HTTPREMOTE_PORT_NUMBER": str(self.server.server_address[1])}
+        cmd = [infra.basepath("support/scripts/dl-prefetch")] + list(args)
+        log = infra.open_log_file(self.builddir, "prefetch", self.logtofile)
+        ret = subprocess.call(cmd, cwd=self.builddir, env=env,
+                              stdout=log, stderr=log)
+        if ret != 0:
+            raise SystemError("Prefetch failed")
+
+    def check_downloaded(self):
+        for pkg in self.packages:
+            name = "{}-1.0.txt".format(pkg)
+            with open(os.path.join(self.httpremotedir, name), "rb") as f:
+                expected = f.read()
+            with open(os.path.join(self.builddir, "dl", pkg, name), "rb") as f:
+                self.assertEqual(f.read(), expected)
+
+
+class TestHttpPrefetch(HttpPrefetchTestBase):
+    def test_run(self):
+        self.prefetch("-j", "2", "--per-origin", "1", *self.packages)
+        self.check_downloaded()
+        # Already downloaded files are only checked again
+        self.prefetch(*self.packages)
+        self.check_downloaded()
+
+
+class TestHttpPrefetchMirrors(HttpPrefetchTestBase):
+    # Nothing listens there, so the upstream site must win the race
+    config = \
+        """
+        BR2_PRIMARY_SITE="http://localhost:1/primary"
+        BR2_BACKUP_SITE="http://localhost:1/backup"
+        """
+
+    def test_run(self):
+        self.prefetch(*self.packages)
+        self.check_downloaded()
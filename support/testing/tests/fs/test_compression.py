@@ -0,0 +1,55 @@
+import os
+import subprocess
+
+import infra.basetest
+
+
+class TestCompressionReproducible(infra.basetest.BRTest):
+    config = infra.basetest.BASIC_TOOLCHAIN_CONFIG + \
+        """
+        BR2_INIT_NONE=y
+        BR2_SYSTEM_BIN_SH_NONE=y
+        # BR2_PACKAGE_BUSYBOX is not set
+        BR2_REPRODUCIBLE=y
+        BR2_TARGET_ROOTFS_CPIO=y
+        BR2_TARGET_ROOTFS_CPIO_GZIP=y
+        BR2_TARGET_ROOTFS_EXT2=y
+        BR2_TARGET_ROOTFS_EXT2_4=y
+        BR2_TARGET_ROOTFS_EXT2_ZSTD=y
+        BR2_TARGET_ROOTFS_TAR=y
+        BR2_TARGET_ROOTFS_TAR_XZ=y
+        """
+    images = [("CPIO", "rootfs.cpio", ".gz"),
+              ("EXT2", "rootfs.ext2", ".zst"),
+              ("TAR", "rootfs.tar", ".xz")]
+
+    def compress_cmd(self, fs, jobs):
+        """Return the command the build would use to compress the fs
+        image with BR2_JLEVEL=jobs."""
+        var = "ROOTFS_{}_COMPRESS_CMD".format(fs)
+        out = subprocess.check_output(["make", "-s", "--no-print-directory",
+                                       "BR2_JLEVEL={}".format(jobs),
+                                       "VARS={}".format(var), "printvars"],
+                                      cwd=self.builddir, universal_newlines=True)
+        return out.strip().split("=", 1)[1]
+
+    def compress(self, cmd, image):
+        env = {"PATH": "{}:{}".format(os.path.join(self.builddir, "host", "bin"),
+                                      os.environ["PATH"])}
+        return subprocess.check_output("{} images/{}".format(cmd, image),
+                                       shell=True, cwd=self.builddir, env=env)
+
+    def test_run(self):
+        for fs, image, ext in self.images:
+            with open(os.path.join(self.builddir, "images", image + ext), "rb") as f:
+                built = f.read()
+            # BR2_JLEVEL=1 still uses two threads, as the single-threaded
+            # code path of the compressors gives a different output.
+            few_cmd = self.compress_cmd(fs, 1)
+            self.assertRegex(few_cmd, r"(-p |-T ?)2( |$)")
+            few = self.compress(few_cmd, image)
+            many = self.compress(self.compress_cmd(fs, 8), image)
+            self.assertEqual(few, many,
+                             "{}{} differs between 2 and 8 threads".format(image, ext))
+            self.assertEqual(few, built,
+                             "{}{} differs from the built image".format(image, ext))
@@ -0,0 +1,57 @@
+import os
+
+import infra.basetest
+from tests.fs.test_ext import boot_img_and_check_fs_type
+
+
+class TestExt4Incremental(infra.basetest.BRTest):
+    config = infra.basetest.BASIC_TOOLCHAIN_CONFIG + \
+        """
+        BR2_TARGET_ROOTFS_EXT2=y
+        BR2_TARGET_ROOTFS_EXT2_4=y
+        BR2_TARGET_ROOTFS_EXT2_SIZE="16384"
+        BR2_TARGET_ROOTFS_INCREMENTAL=y
+        # BR2_TARGET_ROOTFS_TAR is not set
+        """
+
+    def write_target_file(self, path, content):
+        with open(os.path.join(self.builddir, "target", path), "w") as f:
+            f.write(content)
+
+    def image_file(self, path):
+        cmd = ["host/sbin/debugfs", "-R", "cat /{}".format(path),
+               os.path.join("images", "rootfs.ext4")]
+        return infra.run_cmd_on_host(self.builddir, cmd)
+
+    def test_run(self):
+        self.write_target_file("etc/incremental-modified", "old\n")
+        self.write_target_file("etc/incremental-removed", "removed\n")
+        self.b.build()
+        self.assertEqual(self.image_file("etc/incremental-modified"), "old\n")
+        self.assertEqual(self.image_file("etc/incremental-removed"), "removed\n")
+
+        self.write_target_file("etc/incremental-added", "added\n")
+        self.write_target_file("etc/incremental-modified", "new\n")
+        os.unlink(os.path.join(self.builddir, "target", "etc/incremental-removed"))
+        self.b.build()
+
+        # The image was updated, rather than generated again
+        with open(os.path.join(self.builddir, "build", "buildroot-fs",
+                               "ext2", "changes")) as f:
+            changes = f.read()
+        self.assertIn('rm "/etc/incremental-removed"', changes)
+        self.assertIn('"incremental-added"', changes)
+
+        self.assertEqual(self.image_file("etc/incremental-added"), "added\n")
+        self.assertEqual(self.image_file("etc/incremental-modified"), "new\n")
+        self.assertEqual(self.image_file("etc/incremental-removed"), "")
+        self.assertIn("root:", self.image_file("etc/passwd"))
+
+        cmd = ["host/sbin/e2fsck", "-fn", os.path.join("images", "rootfs.ext4")]
+        infra.run_cmd_on_host(self.builddir, cmd)
+
+        exit_code = boot_img_and_check_fs_type(self.emulator,
+                                               self.builddir, "ext4")
+        self.assertEqual(exit_code, 0)
+        self.assertRunOk("grep -q new /etc/incremental-modified")
+        self.assertRunOk("test ! -e /etc/incremental-removed")
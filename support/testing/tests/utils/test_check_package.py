@@ -7,7 +7,9 @@ The make target ('make check-package') is already used by the job
 'check-package' and won't be tested here.
 """
 import os
+import shutil
 import subprocess
+import tempfile
 import unittest
 
 import infra
@@ -250,3 +252,23 @@ class TestCheckPackage(unittest.TestCase):
         self.assert_file_was_processed(m)
         self.assert_warnings_generated_for_file(m)
         self.assertIn("{}:0: run 'shellcheck' and fix the warnings".format(abs_file), w)
+
+    def test_parallel_and_cache(self):
+        """Test that the warnings are the same, and in the same order, whether
+        the files are checked in parallel or not, and their results cached or
+        not."""
+        abs_path = infra.filepath("tests/utils/br2-external")
+        files = ["Config.in", "external.mk", "package/external/external.mk",
+                 "utils/x-shellscript"]
+        cache_dir = tempfile.mkdtemp()
+        try:
+            expected = call_script(["check-package", "-b", "-j1"] + files,
+                                   self.WITH_UTILS_IN_PATH, abs_path)
+            self.assert_warnings_generated_for_file(expected[1])
+            for _ in range(2):
+                result = call_script(["check-package", "-b", "-j4", "--cache-dir", cache_dir] + files,
+                                     self.WITH_UTILS_IN_PATH, abs_path)
+                self.assertEqual(result, expected)
+            self.assertNotEqual(os.listdir(cache_dir), [])
+        finally:
+            shutil.rmtree(cache_dir)